@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "allocators.hxx"
+
+using namespace luai;
+
+namespace {
+    constexpr std::size_t ALIGNMENT {16};
+
+    constexpr std::size_t align_up(std::size_t n) noexcept {
+        return (n + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    }
+}
+
+// slabs are chained through their headers
+struct alignas(ALIGNMENT) pool_allocator::slab {
+    slab *next;
+};
+
+constexpr std::size_t pool_allocator::GRANULARITY;
+constexpr std::size_t pool_allocator::MAX_SMALL;
+constexpr std::size_t pool_allocator::NCLASSES;
+
+pool_allocator::pool_allocator(std::size_t slab_size)
+    : slab_size{std::max(align_up(slab_size), MAX_SMALL)}
+{}
+
+pool_allocator::~pool_allocator() {
+    reset();
+}
+
+void *pool_allocator::obtain(std::size_t n) noexcept {
+    if (n > MAX_SMALL)
+        return std::malloc(n);
+    auto cls = (n - 1) / GRANULARITY;
+    if (auto block = free_lists[cls]) {
+        free_lists[cls] = block->next;
+        return block;
+    }
+    auto size = (cls + 1) * GRANULARITY;
+    if (static_cast<std::size_t>(slab_end - slab_top) < size) {
+        auto fresh = static_cast<slab *>(std::malloc(sizeof(slab) + slab_size));
+        if (!fresh)
+            return nullptr;
+        fresh->next = slabs;
+        slabs = fresh;
+        ++nslabs;
+        slab_top = reinterpret_cast<char *>(fresh + 1);
+        slab_end = slab_top + slab_size;
+    }
+    auto block = slab_top;
+    slab_top += size;
+    return block;
+}
+
+void pool_allocator::release(void *p, std::size_t n) noexcept {
+    if (n > MAX_SMALL) {
+        std::free(p);
+        return;
+    }
+    auto cls = (n - 1) / GRANULARITY;
+    auto block = static_cast<free_block *>(p);
+    block->next = free_lists[cls];
+    free_lists[cls] = block;
+}
+
+void *pool_allocator::realloc(void *ptr, std::size_t osize, std::size_t nsize) noexcept {
+    auto oldsize = ptr ? osize : 0;
+    if (nsize == 0) {
+        if (ptr)
+            release(ptr, oldsize);
+        return nullptr;
+    }
+    if (ptr) {
+        // same size class, or both from malloc
+        if (oldsize <= MAX_SMALL && nsize <= MAX_SMALL
+            && (oldsize - 1) / GRANULARITY == (nsize - 1) / GRANULARITY)
+            return ptr;
+        if (oldsize > MAX_SMALL && nsize > MAX_SMALL)
+            return std::realloc(ptr, nsize);
+    }
+    auto block = obtain(nsize);
+    // on failure lua still owns the old block
+    if (block && ptr) {
+        std::memcpy(block, ptr, std::min(oldsize, nsize));
+        release(ptr, oldsize);
+    }
+    return block;
+}
+
+void pool_allocator::reset() noexcept {
+    while (slabs) {
+        auto next = slabs->next;
+        std::free(slabs);
+        slabs = next;
+    }
+    nslabs = 0;
+    slab_top = slab_end = nullptr;
+    std::fill(std::begin(free_lists), std::end(free_lists), nullptr);
+}
+
+std::size_t pool_allocator::slab_bytes() const noexcept {
+    return nslabs * (sizeof(slab) + slab_size);
+}
+
+arena_allocator::arena_allocator(std::size_t capacity)
+    : base{static_cast<char *>(std::malloc(align_up(capacity)))}
+    , capacity{align_up(capacity)}
+{
+    if (!base)
+        throw luastate_error{"cannot allocate arena: out of memory"};
+}
+
+arena_allocator::~arena_allocator() {
+    std::free(base);
+}
+
+bool arena_allocator::owns(const void *p) const noexcept {
+    auto c = static_cast<const char *>(p);
+    return c >= base && c < base + capacity;
+}
+
+void *arena_allocator::realloc(void *ptr, std::size_t osize, std::size_t nsize) noexcept {
+    auto oldsize = ptr ? osize : 0;
+    if (ptr && !owns(ptr)) {
+        // fallback block from malloc
+        if (nsize == 0) {
+            std::free(ptr);
+            return nullptr;
+        }
+        return std::realloc(ptr, nsize);
+    }
+    auto is_last = ptr && static_cast<char *>(ptr) == base + last;
+    if (nsize == 0) {
+        if (is_last)
+            top = last;
+        return nullptr;
+    }
+    if (is_last && last + align_up(nsize) <= capacity) {
+        top = last + align_up(nsize);
+        return ptr;
+    }
+    if (ptr && nsize <= oldsize)
+        return ptr;
+
+    void *block;
+    if (top + align_up(nsize) <= capacity) {
+        block = base + top;
+        last = top;
+        top += align_up(nsize);
+    } else {
+        block = std::malloc(nsize);
+        if (!block)
+            return nullptr;
+    }
+    if (ptr)
+        std::memcpy(block, ptr, std::min(oldsize, nsize));
+    return block;
+}
+
+void arena_allocator::reset() noexcept {
+    top = last = 0;
+}
+
+std::size_t arena_allocator::used() const noexcept {
+    return top;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+
+#include "lua_interpreter.hxx"
+
+namespace luai {
+
+// size class allocator tuned for the many small strings, tables and closures of lua.
+// blocks up to MAX_SMALL bytes come from per class free lists carved out of slabs,
+// larger ones from malloc. slabs are given back only by reset() or destruction
+class pool_allocator : public allocator {
+public:
+    static constexpr std::size_t GRANULARITY {16};
+    static constexpr std::size_t MAX_SMALL {256};
+
+    explicit pool_allocator(std::size_t slab_size = 64 * 1024);
+    ~pool_allocator() override;
+
+    // COPYING DELETED
+    pool_allocator(const pool_allocator &) = delete;
+    pool_allocator &operator=(const pool_allocator &) = delete;
+
+    void *realloc(void *ptr, std::size_t osize, std::size_t nsize) noexcept override;
+    void reset() noexcept override;
+
+    // bytes taken from malloc for slabs
+    std::size_t slab_bytes() const noexcept;
+
+private:
+    static constexpr std::size_t NCLASSES {MAX_SMALL / GRANULARITY};
+
+    struct free_block { free_block *next; };
+    struct slab;
+
+    void *obtain(std::size_t n) noexcept;
+    void release(void *p, std::size_t n) noexcept;
+
+    std::size_t slab_size;
+    std::size_t nslabs {};
+    slab *slabs {};
+    char *slab_top {};
+    char *slab_end {};
+    free_block *free_lists[NCLASSES] {};
+};
+
+// bump allocator over one preallocated region, for short lived "request" states that are
+// reset() after each use. freeing only rewinds if the block was the last one allocated,
+// everything else is reclaimed by reset(). when the region is full it falls back to malloc
+class arena_allocator : public allocator {
+public:
+    explicit arena_allocator(std::size_t capacity = 1 << 20);
+    ~arena_allocator() override;
+
+    // COPYING DELETED
+    arena_allocator(const arena_allocator &) = delete;
+    arena_allocator &operator=(const arena_allocator &) = delete;
+
+    void *realloc(void *ptr, std::size_t osize, std::size_t nsize) noexcept override;
+    void reset() noexcept override;
+
+    // bytes of the region handed out since the last reset()
+    std::size_t used() const noexcept;
+
+private:
+    bool owns(const void *p) const noexcept;
+
+    char *base;
+    std::size_t capacity;
+    std::size_t top {};
+    // offset of the last block, the only one that can grow or be freed in place
+    std::size_t last {};
+};
+
+} // namespace luai
@@ -0,0 +1,637 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lua.hpp"
+
+#include "allocators.hxx"
+#include "interpreter_pool.hxx"
+#include "lua_interpreter.hxx"
+#include "script_scheduler.hxx"
+
+using namespace luai;
+
+using bench_clock = std::chrono::steady_clock;
+
+// c++ heap allocations of the whole program, counted by demo_bench_heap.cxx
+extern std::atomic<std::size_t> heap_allocations;
+
+// runs f once, returns elapsed seconds
+template<class F>
+double time_once(F &&f) {
+    auto start = bench_clock::now();
+    f();
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// prints throughput of a benchmark that completed ops operations in secs seconds
+void report(const std::string &name, double ops, double secs) {
+    std::cout << name << ": " << static_cast<long long>(ops / secs) << " op/s, "
+              << secs * 1e9 / ops << " ns/op" << std::endl;
+}
+
+// prints the median and 99th percentile of latencies in seconds
+void report_latency(const std::string &name, std::vector<double> secs) {
+    std::sort(secs.begin(), secs.end());
+    auto at = [&](double q) { return secs[static_cast<std::size_t>(q * (secs.size() - 1))] * 1e6; };
+    std::cout << name << ": p50 " << at(0.5) << " us, p99 " << at(0.99) << " us" << std::endl;
+}
+
+// cpu bound script, roughly tens of microseconds per run
+constexpr auto POOL_SCRIPT = "local s = base for i = 1, 2000 do s = s + i % 7 end result = s";
+constexpr auto POOL_TASKS = 4000;
+
+// pool of n states against n threads sharing one mutex protected state
+void bench_pool_scaling() {
+    for (auto threads : {1, 2, 4, 8, 16, 32}) {
+        auto pool = interpreter_pool{static_cast<std::size_t>(threads), {"base = 1"}};
+        auto secs = time_once([&] {
+            auto results = std::vector<std::future<std::tuple<bool, std::string>>>{};
+            results.reserve(POOL_TASKS);
+            for (auto i = 0; i < POOL_TASKS; ++i)
+                results.emplace_back(pool.submit_chunk(POOL_SCRIPT));
+            for (auto &r : results)
+                r.get();
+        });
+        report("pool/" + std::to_string(threads), POOL_TASKS, secs);
+
+        auto state = lua_interpreter{};
+        state.openlibs();
+        state.run_chunk("base = 1");
+        std::mutex lock;
+        secs = time_once([&] {
+            auto workers = std::vector<std::thread>{};
+            for (auto t = 0; t < threads; ++t)
+                workers.emplace_back([&, t] {
+                    for (auto i = t; i < POOL_TASKS; i += threads) {
+                        std::lock_guard<std::mutex> guard{lock};
+                        state.run_cached(POOL_SCRIPT);
+                    }
+                });
+            for (auto &w : workers)
+                w.join();
+        });
+        report("mutex/" + std::to_string(threads), POOL_TASKS, secs);
+    }
+}
+
+// reading a record field by field against get_fields()
+void bench_get_fields() {
+    constexpr auto ROWS = 200000;
+    auto state = lua_interpreter{};
+    state.run_chunk("row = { a = 1, b = 2, c = 3.5, d = 'name', e = true, f = 6, g = 7.5, h = 'x' }");
+    auto tbl = state.get_global<types::TABLE>("row");
+    auto sink = 0.0;
+    auto secs = time_once([&] {
+        for (auto i = 0; i < ROWS; ++i) {
+            sink += tbl.get_field<types::INT>("a") + tbl.get_field<types::INT>("b")
+                + tbl.get_field<types::NUM>("c") + tbl.get_field<types::STR>("d").size()
+                + tbl.get_field<types::BOOL>("e") + tbl.get_field<types::INT>("f")
+                + tbl.get_field<types::NUM>("g") + tbl.get_field<types::STR>("h").size();
+        }
+    });
+    report("get_field x8", ROWS, secs);
+    secs = time_once([&] {
+        for (auto i = 0; i < ROWS; ++i) {
+            auto r = tbl.get_fields<types::INT, types::INT, types::NUM, types::STR,
+                                    types::BOOL, types::INT, types::NUM, types::STR>(
+                {"a", "b", "c", "d", "e", "f", "g", "h"});
+            sink += std::get<0>(r) + std::get<1>(r) + std::get<2>(r) + std::get<3>(r).size()
+                + std::get<4>(r) + std::get<5>(r) + std::get<6>(r) + std::get<7>(r).size();
+        }
+    });
+    report("get_fields x8", ROWS, secs);
+    if (sink < 0)
+        std::cout << sink << std::endl;
+}
+
+// per-index loop against to_vector() and copy_into() on large numeric arrays
+void bench_to_vector() {
+    for (auto n : {10000, 1000000}) {
+        auto state = lua_interpreter{};
+        state.run_chunk(("arr = {} for i = 1, " + std::to_string(n) + " do arr[i] = i * 0.5 end").c_str());
+        auto arr = state.get_global<types::TABLE>("arr");
+        auto suffix = "/" + std::to_string(n);
+        auto out = std::vector<double>{};
+        auto secs = time_once([&] {
+            auto len = arr.len();
+            out.clear();
+            out.reserve(static_cast<std::size_t>(len));
+            for (auto i = 1LL; i <= len; ++i)
+                out.emplace_back(arr.get_index<types::NUM>(i));
+        });
+        report("get_index loop" + suffix, n, secs);
+        secs = time_once([&] { out = arr.to_vector<types::NUM>(); });
+        report("to_vector" + suffix, n, secs);
+        secs = time_once([&] { arr.copy_into<types::NUM>(out.data(), out.size()); });
+        report("copy_into" + suffix, n, secs);
+    }
+}
+
+// allocation heavy request against the system, pool and arena allocators.
+// the arena state is reset after every request
+void bench_allocators() {
+    constexpr auto REQUESTS = 200;
+    constexpr auto SCRIPT = "local t = {} for i = 1, 2000 do t[i] = { id = i, name = 'n' .. i } end";
+    auto run = [&](const std::string &name, std::shared_ptr<allocator> alloc, bool reset) {
+        auto state = lua_interpreter{std::move(alloc)};
+        auto secs = time_once([&] {
+            for (auto i = 0; i < REQUESTS; ++i) {
+                state.run_cached(SCRIPT);
+                if (reset)
+                    state.reset();
+            }
+        });
+        report(name, REQUESTS, secs);
+    };
+    run("alloc/malloc", nullptr, false);
+    run("alloc/pool", std::make_shared<pool_allocator>(), false);
+    run("alloc/malloc+reset", nullptr, true);
+    run("alloc/arena+reset", std::make_shared<arena_allocator>(8 << 20), true);
+}
+
+// hand written counterpart of the generated trampoline
+int add_cfunction(lua_State *L) {
+    auto a = luaL_checkinteger(L, 1);
+    auto b = luaL_checkinteger(L, 2);
+    lua_pushinteger(L, a + b);
+    return 1;
+}
+
+// cost of a call into c++ through register_function() against a plain lua_CFunction
+void bench_native_call() {
+    constexpr auto CALLS = 2000000;
+    auto state = lua_interpreter{};
+    state.register_function("add_generated", [](long long a, long long b) { return a + b; });
+    state.register_function("add_c", add_cfunction);
+    state.run_chunk("function loop(f, n) local s = 0 for i = 1, n do s = f(s, 1) end return s end");
+    auto baseline = time_once([&] { state.run_chunk("loop(function(a, b) return a + b end, 2000000)"); });
+    report("call/lua function", CALLS, baseline);
+    report("call/lua_CFunction", CALLS, time_once([&] { state.run_chunk("loop(add_c, 2000000)"); }));
+    report("call/register_function", CALLS, time_once([&] { state.run_chunk("loop(add_generated, 2000000)"); }));
+}
+
+// calls of a lua scoring function through function_handle
+void bench_function_call() {
+    constexpr auto CALLS = 1000000;
+    auto state = lua_interpreter{};
+    state.run_chunk(
+        "function score(x, w) return x * w + 1 end\n"
+        "function minmax(a, b) if a < b then return a, b end return b, a end\n"
+    );
+    auto score = state.get_global<types::FUNC>("score");
+    auto minmax = state.get_global<types::FUNC>("minmax");
+    auto sink = 0.0;
+    report("function_handle/1 result", CALLS, time_once([&] {
+        for (auto i = 0; i < CALLS; ++i)
+            sink += score.call<types::NUM>(i, 0.5);
+    }));
+    report("function_handle/2 results", CALLS, time_once([&] {
+        for (auto i = 0; i < CALLS; ++i)
+            sink += std::get<1>(minmax.call<types::INT, types::INT>(i, CALLS - i));
+    }));
+    if (sink < 0)
+        std::cout << sink << std::endl;
+}
+
+// the helper from demo_test.cxx
+template<types Type>
+auto get_field_recur(lua_interpreter &state, const std::vector<std::string> &names) {
+    if (names.size() == 1)
+        return state.get_global<Type>(names[0].c_str());
+    auto staq = std::vector<table_handle>{};
+    staq.emplace_back(state.get_global<types::TABLE>(names[0].c_str()));
+    for (size_t i = 1; i < names.size()-1; ++i)
+        staq.emplace_back(staq[i-1].get_field<types::TABLE>(names[i].c_str()));
+    return staq.back().get_field<Type>(names.back().c_str());
+}
+
+// repeated deep lookups: walking the path each time against a table_ref to the leaf table
+void bench_deep_lookup() {
+    constexpr auto LOOKUPS = 500000;
+    auto state = lua_interpreter{};
+    state.run_chunk("config = { service = { limits = { tenant = { rate = 42 } } } }");
+    auto path = std::vector<std::string>{"config", "service", "limits", "tenant", "rate"};
+    auto sink = 0LL;
+    report("deep/get_field_recur", LOOKUPS, time_once([&] {
+        for (auto i = 0; i < LOOKUPS; ++i)
+            sink += get_field_recur<types::INT>(state, path);
+    }));
+    auto before = heap_allocations.load();
+    for (auto i = 0; i < LOOKUPS; ++i)
+        sink += get_field_recur<types::INT>(state, path);
+    std::cout << "deep/get_field_recur: " << static_cast<double>(heap_allocations - before) / LOOKUPS
+              << " allocations/op" << std::endl;
+    auto by_frames = [&] {
+        auto config = state.frame_global("config");
+        auto service = config.frame_field("service");
+        auto limits = service.frame_field("limits");
+        auto tenant = limits.frame_field("tenant");
+        return tenant.get_field<types::INT>("rate");
+    };
+    report("deep/table_frame", LOOKUPS, time_once([&] {
+        for (auto i = 0; i < LOOKUPS; ++i)
+            sink += by_frames();
+    }));
+    before = heap_allocations.load();
+    for (auto i = 0; i < LOOKUPS; ++i)
+        sink += by_frames();
+    std::cout << "deep/table_frame: " << static_cast<double>(heap_allocations - before) / LOOKUPS
+              << " allocations/op" << std::endl;
+    auto tenant = state.get_global<types::TABLE>("config")
+        .get_field<types::TABLE>("service")
+        .get_field<types::TABLE>("limits")
+        .get_field<types::TABLE>("tenant")
+        .to_ref();
+    report("deep/table_ref", LOOKUPS, time_once([&] {
+        for (auto i = 0; i < LOOKUPS; ++i)
+            sink += tenant.get_field<types::INT>("rate");
+    }));
+    if (sink < 0)
+        std::cout << sink << std::endl;
+}
+
+// reading strings as copies against views, short and multi-KB
+void bench_string_view() {
+    constexpr auto READS = 500000;
+    auto state = lua_interpreter{};
+    state.openlibs();
+    state.run_chunk("short = 'tenant-a' long = string.rep('x', 4096)");
+    for (auto name : {"short", "long"}) {
+        auto sink = std::size_t{};
+        report(std::string{"str/"} + name, READS, time_once([&] {
+            for (auto i = 0; i < READS; ++i)
+                sink += state.get_global<types::STR>(name).size();
+        }));
+        report(std::string{"strview/"} + name, READS, time_once([&] {
+            // one guard per read, like a request scoped guard
+            for (auto i = 0; i < READS; ++i) {
+                auto guard = view_guard{state};
+                sink += state.get_global<types::STRVIEW>(name).size();
+            }
+        }));
+        if (sink == 0)
+            std::cout << sink << std::endl;
+    }
+}
+
+// draining a table pair by pair through the iterator and in batches, against reading
+// it by known keys, for the array part (t[i] = i) and the hash part (t['k' .. i] = i)
+void bench_iteration() {
+    for (auto n : {1000, 10000, 100000, 1000000}) {
+        auto state = lua_interpreter{};
+        auto keys = std::vector<std::string>{};
+        keys.reserve(n);
+        for (auto i = 1; i <= n; ++i)
+            keys.emplace_back("k" + std::to_string(i));
+        state.run_chunk(("n = " + std::to_string(n) + "\n"
+            "arr = {} for i = 1, n do arr[i] = i end\n"
+            "map = {} for i = 1, n do map['k' .. i] = i end\n").c_str());
+        auto rounds = std::max(1, 1000000 / n);
+        auto ops = static_cast<double>(rounds) * n;
+        auto suffix = "/" + std::to_string(n);
+        auto sink = 0ll;
+        for (auto part : {"arr", "map"}) {
+            auto tbl = state.get_global<types::TABLE>(part);
+            auto is_array = std::string{part} == "arr";
+            report(std::string{"iterate/"} + part + "/keys" + suffix, ops, time_once([&] {
+                for (auto r = 0; r < rounds; ++r)
+                    for (auto i = 0; i < n; ++i)
+                        sink += is_array ? tbl.get_index<types::INT>(i + 1)
+                                         : tbl.get_field<types::INT>(keys[i].c_str());
+            }));
+            report(std::string{"iterate/"} + part + "/iterator" + suffix, ops, time_once([&] {
+                for (auto r = 0; r < rounds; ++r)
+                    for (auto &pair : tbl)
+                        sink += pair.value.integer;
+            }));
+            for (auto k : {16, 256, 4096}) {
+                auto batch = table_batch{static_cast<std::size_t>(k)};
+                report(std::string{"iterate/"} + part + "/batch" + std::to_string(k) + suffix, ops, time_once([&] {
+                    for (auto r = 0; r < rounds; ++r) {
+                        batch.rewind();
+                        while (tbl.next_batch(batch))
+                            for (auto &pair : batch)
+                                sink += pair.value.integer;
+                    }
+                }));
+            }
+        }
+        if (sink == 0)
+            std::cout << sink << std::endl;
+    }
+}
+
+struct bench_row {
+    long long id;
+    std::string name;
+    double score;
+};
+
+template<>
+struct luai::table_fields<bench_row> {
+    static constexpr std::size_t size = 3;
+    static void build(table_builder &t, const bench_row &row) {
+        t.field("id", row.id).field("name", row.name).field("score", row.score);
+    }
+};
+
+// 1M element inputs built with set_global(), against generating lua source for run_chunk()
+void bench_build_tables() {
+    constexpr auto N = 1000000;
+    auto state = lua_interpreter{};
+    auto nums = std::vector<double>{};
+    auto map = std::unordered_map<std::string, long long>{};
+    auto rows = std::vector<bench_row>{};
+    for (auto i = 0; i < N; ++i) {
+        nums.push_back(i * 0.5);
+        map.emplace("k" + std::to_string(i), i);
+        rows.push_back({i, "n" + std::to_string(i), i * 0.25});
+    }
+    auto run_text = [&](const std::string &name, auto &&generate) {
+        report(name, N, time_once([&] {
+            auto code = std::string{"input = {"};
+            generate(code);
+            code += "}";
+            state.run_chunk(code.c_str());
+        }));
+        state.run_chunk("input = nil collectgarbage()");
+    };
+    auto run_builder = [&](const std::string &name, const auto &value) {
+        report(name, N, time_once([&] { state.set_global("input", value); }));
+        state.run_chunk("input = nil collectgarbage()");
+    };
+
+    run_text("build/vector/text", [&](std::string &code) {
+        for (auto v : nums)
+            code += std::to_string(v) + ",";
+    });
+    run_builder("build/vector/set_global", nums);
+    run_text("build/map/text", [&](std::string &code) {
+        for (auto &pair : map)
+            code += "[\"" + pair.first + "\"]=" + std::to_string(pair.second) + ",";
+    });
+    run_builder("build/map/set_global", map);
+    run_text("build/structs/text", [&](std::string &code) {
+        for (auto &row : rows)
+            code += "{id=" + std::to_string(row.id) + ",name=\"" + row.name + "\",score="
+                + std::to_string(row.score) + "},";
+    });
+    run_builder("build/structs/set_global", rows);
+}
+
+// cost of the budget hook on a cpu bound script, by hook interval
+void bench_budget() {
+    constexpr auto RUNS = 20;
+    auto state = lua_interpreter{};
+    auto chunk = state.load_chunk("local s = 0 for i = 1, 1000000 do s = s + i % 7 end");
+    report("budget/none", RUNS, time_once([&] {
+        for (auto i = 0; i < RUNS; ++i)
+            state.run_chunk(chunk);
+    }));
+    auto memory_only = exec_budget{};
+    memory_only.memory = 1 << 20;
+    report("budget/memory_only", RUNS, time_once([&] {
+        for (auto i = 0; i < RUNS; ++i)
+            state.run_chunk(chunk, memory_only);
+    }));
+    for (auto interval : {10, 100, 1000, 10000}) {
+        auto limits = exec_budget{};
+        limits.instructions = 1ull << 40;
+        limits.wall_time = std::chrono::seconds{60};
+        limits.hook_interval = interval;
+        report("budget/interval" + std::to_string(interval), RUNS, time_once([&] {
+            for (auto i = 0; i < RUNS; ++i)
+                state.run_chunk(chunk, limits);
+        }));
+    }
+}
+
+// a clean environment per request: a fresh state with libraries and bootstrap against
+// restoring the globals of one warm state. the request leaves globals behind
+void bench_sandbox() {
+    constexpr auto REQUESTS = 2000;
+    auto bootstrap = std::string{"handlers = {}\n"};
+    for (auto i = 0; i < 200; ++i)
+        bootstrap += "function handler" + std::to_string(i) + "(req) return req.n + " + std::to_string(i) + " end\n"
+                   + "handlers[" + std::to_string(i + 1) + "] = { name = 'h" + std::to_string(i) + "', weight = " + std::to_string(i) + " }\n";
+    auto request = "req = { n = 1 } result = handler42(req) scratch = {} for i = 1, 100 do scratch[i] = i end";
+
+    auto fresh = std::vector<double>{};
+    for (auto i = 0; i < REQUESTS; ++i) {
+        fresh.push_back(time_once([&] {
+            auto state = lua_interpreter{};
+            state.openlibs();
+            state.run_chunk(bootstrap.c_str());
+        }));
+    }
+    report_latency("sandbox/fresh_state", fresh);
+
+    auto warm = lua_interpreter{};
+    warm.openlibs();
+    warm.run_chunk(bootstrap.c_str());
+    warm.snapshot_globals();
+    auto restored = std::vector<double>{};
+    for (auto i = 0; i < REQUESTS; ++i) {
+        warm.run_cached(request);
+        restored.push_back(time_once([&] { warm.restore_globals(); }));
+    }
+    report_latency("sandbox/restore_globals", restored);
+}
+
+struct bench_endpoint {
+    std::string host;
+    long long port;
+};
+
+struct bench_service {
+    std::string name;
+    bool enabled;
+    double weight;
+    bench_endpoint primary;
+    std::vector<bench_endpoint> replicas;
+    std::vector<long long> ports;
+};
+
+template<>
+struct luai::table_fields<bench_endpoint> {
+    static constexpr auto members = std::make_tuple(
+        member("host", &bench_endpoint::host), member("port", &bench_endpoint::port));
+};
+
+template<>
+struct luai::table_fields<bench_service> {
+    static constexpr auto members = std::make_tuple(
+        member("name", &bench_service::name), member("enabled", &bench_service::enabled),
+        member("weight", &bench_service::weight), member("primary", &bench_service::primary),
+        member("replicas", &bench_service::replicas), member("ports", &bench_service::ports));
+};
+
+// the per field code table_fields members replace
+bench_service read_service(lua_interpreter &state) {
+    auto result = bench_service{};
+    auto svc = state.get_global<types::TABLE>("svc");
+    result.name = svc.get_field<types::STR>("name");
+    result.enabled = svc.get_field<types::BOOL>("enabled");
+    result.weight = svc.get_field<types::NUM>("weight");
+    {
+        auto primary = svc.get_field<types::TABLE>("primary");
+        result.primary = {primary.get_field<types::STR>("host"), primary.get_field<types::INT>("port")};
+    }
+    {
+        auto replicas = svc.get_field<types::TABLE>("replicas");
+        auto n = replicas.len();
+        for (auto i = 1ll; i <= n; ++i) {
+            auto replica = replicas.get_index<types::TABLE>(i);
+            result.replicas.push_back({replica.get_field<types::STR>("host"), replica.get_field<types::INT>("port")});
+        }
+    }
+    result.ports = svc.get_field<types::TABLE>("ports").to_vector<types::INT>();
+    return result;
+}
+
+// a config table with a nested table and vectors, read by hand against as<T>(), both
+// starting from a table_handle to the global
+void bench_struct_mapping() {
+    constexpr auto READS = 100000;
+    auto state = lua_interpreter{};
+    state.run_chunk(
+        "svc = { name = 'api', enabled = true, weight = 0.5, primary = { host = 'a', port = 80 },\n"
+        "  replicas = {}, ports = {} }\n"
+        "for i = 1, 8 do svc.replicas[i] = { host = 'replica' .. i, port = 8000 + i } svc.ports[i] = i end\n"
+    );
+    auto sink = 0ll;
+    report("struct/hand_written", READS, time_once([&] {
+        for (auto i = 0; i < READS; ++i)
+            sink += read_service(state).replicas.back().port;
+    }));
+    report("struct/as", READS, time_once([&] {
+        for (auto i = 0; i < READS; ++i)
+            sink += state.get_global<types::TABLE>("svc").as<bench_service>().replicas.back().port;
+    }));
+    auto svc = state.frame_global("svc").as<bench_service>();
+    report("struct/push", READS, time_once([&] {
+        for (auto i = 0; i < READS; ++i)
+            state.set_global("copy", svc);
+    }));
+    if (sink < 0)
+        std::cout << sink << std::endl;
+}
+
+// compare the numbers of a build with and without -DLUAI_INSTRUMENT=ON
+void bench_instruments() {
+    constexpr auto N = 1000000;
+    constexpr auto RUNS = 20;
+    auto state = lua_interpreter{};
+    state.run_chunk("x = 42 f = function(n) return n end");
+    auto tag = std::string{state.get_instruments().enabled ? "instruments/on/" : "instruments/off/"};
+    auto sink = 0ll;
+    report(tag + "get_global", N, time_once([&] {
+        for (auto i = 0; i < N; ++i)
+            sink += state.get_global<types::INT>("x");
+    }));
+    auto f = state.get_global<types::FUNC>("f");
+    report(tag + "call", N, time_once([&] {
+        for (auto i = 0; i < N; ++i)
+            sink += f.call<types::INT>(i);
+    }));
+    auto chunk = state.load_chunk("local s = 0 for i = 1, 1000000 do s = s + i % 7 end");
+    report(tag + "run_chunk", RUNS, time_once([&] {
+        for (auto i = 0; i < RUNS; ++i)
+            state.run_chunk(chunk);
+    }));
+    for (auto interval : {100, 10000}) {
+        state.start_profiler(interval);
+        report(tag + "run_chunk_profiled" + std::to_string(interval), RUNS, time_once([&] {
+            for (auto i = 0; i < RUNS; ++i)
+                state.run_chunk(chunk);
+        }));
+        state.stop_profiler();
+    }
+    if (sink < 0)
+        std::cout << sink << std::endl;
+}
+
+// scripts waiting on 1ms operations: coroutines on a few scheduler threads against
+// one thread and state per script blocking in the operation
+void bench_async() {
+    constexpr auto SCRIPT = "for i = 1, 5 do sleep(1) end mark()";
+    for (auto scripts : {100, 1000, 10000}) {
+        for (auto threads : {1, 4}) {
+            auto latencies = std::vector<double>(scripts);
+            auto start = bench_clock::now();
+            auto secs = time_once([&] {
+                auto workers = std::vector<std::thread>{};
+                for (auto t = 0; t < threads; ++t)
+                    workers.emplace_back([&, t] {
+                        auto state = lua_interpreter{};
+                        auto sched = script_scheduler{state};
+                        sched.register_async("sleep", [&](async_call call, long long ms) {
+                            sched.after(std::chrono::milliseconds{ms}, [call]() mutable { call.complete(); });
+                        });
+                        auto next = static_cast<std::size_t>(t);
+                        state.register_function("mark", [&] {
+                            latencies[next] = std::chrono::duration<double>(bench_clock::now() - start).count();
+                            next += threads;
+                        });
+                        for (auto i = t; i < scripts; i += threads)
+                            sched.spawn(SCRIPT);
+                        sched.run();
+                    });
+                for (auto &w : workers)
+                    w.join();
+            });
+            auto name = "async/scheduler" + std::to_string(threads) + "/" + std::to_string(scripts);
+            report(name, scripts, secs);
+            report_latency(name, latencies);
+        }
+        if (scripts > 1000)
+            continue;
+        auto latencies = std::vector<double>(scripts);
+        auto start = bench_clock::now();
+        auto secs = time_once([&] {
+            auto workers = std::vector<std::thread>{};
+            for (auto i = 0; i < scripts; ++i)
+                workers.emplace_back([&, i] {
+                    auto state = lua_interpreter{};
+                    state.register_function("sleep", [](long long ms) {
+                        std::this_thread::sleep_for(std::chrono::milliseconds{ms});
+                    });
+                    state.register_function("mark", [&] {
+                        latencies[i] = std::chrono::duration<double>(bench_clock::now() - start).count();
+                    });
+                    state.run_chunk(SCRIPT);
+                });
+            for (auto &w : workers)
+                w.join();
+        });
+        auto name = "async/thread_per_script/" + std::to_string(scripts);
+        report(name, scripts, secs);
+        report_latency(name, latencies);
+    }
+}
+
+int main() {
+    std::cout << "hardware threads: " << std::thread::hardware_concurrency() << std::endl;
+    bench_pool_scaling();
+    bench_get_fields();
+    bench_to_vector();
+    bench_allocators();
+    bench_native_call();
+    bench_function_call();
+    bench_deep_lookup();
+    bench_string_view();
+    bench_iteration();
+    bench_build_tables();
+    bench_budget();
+    bench_instruments();
+    bench_sandbox();
+    bench_struct_mapping();
+    bench_async();
+}
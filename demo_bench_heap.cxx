@@ -0,0 +1,24 @@
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+// replaces the global operator new of demo_bench to count allocations. kept apart from
+// the benchmarks, so that the replacement is never inlined into them
+
+std::atomic<std::size_t> heap_allocations {};
+
+void *operator new(std::size_t size) {
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (auto p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc{};
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+    std::free(p);
+}
@@ -1,7 +1,20 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <sstream>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
+#include "allocators.hxx"
+#include "interpreter_pool.hxx"
 #include "lua_interpreter.hxx"
+#include "script_scheduler.hxx"
 
 #define ASSERT(condition)                                           \
 do {                                                                \
@@ -23,6 +36,18 @@ do {                                                                \
     ASSERT(thrown);                                                 \
 } while (0)
 
+// like SHOULD_THROW, for exceptions not raised by this library
+#define SHOULD_THROW_ANY(expr)                                      \
+do {                                                                \
+    bool thrown {false};                                            \
+    try {                                                           \
+        expr;                                                       \
+    } catch (std::exception &) {                                    \
+        thrown = true;                                              \
+    }                                                               \
+    ASSERT(thrown);                                                 \
+} while (0)
+
 using namespace luai;
 
 // my helper function to get field recursively
@@ -39,6 +64,83 @@ auto get_field_recur(lua_interpreter &state, const std::vector<std::string> &nam
     // table handles destructed
 }
 
+// written as tables through table_fields
+struct point {
+    double x, y;
+};
+
+struct shape {
+    std::string name;
+    std::vector<point> points;
+};
+
+// build() throws halfway
+struct broken {};
+
+template<>
+struct luai::table_fields<point> {
+    static constexpr std::size_t size = 2;
+    static void build(table_builder &t, const point &p) {
+        t.field("x", p.x).field("y", p.y);
+    }
+};
+
+template<>
+struct luai::table_fields<shape> {
+    static constexpr std::size_t size = 2;
+    static void build(table_builder &t, const shape &s) {
+        t.field("name", s.name).field("points", s.points);
+    }
+};
+
+template<>
+struct luai::table_fields<broken> {
+    static constexpr std::size_t size = 1;
+    static void build(table_builder &t, const broken &) {
+        t.field("ok", 1);
+        throw std::runtime_error{"broken"};
+    }
+};
+
+// read and written through table_fields members
+struct endpoint {
+    std::string host;
+    int port;
+};
+
+struct service {
+    std::string name;
+    bool enabled;
+    double weight;
+    endpoint primary;
+    std::vector<endpoint> replicas;
+    std::vector<long long> ports;
+};
+
+template<>
+struct luai::table_fields<endpoint> {
+    static constexpr auto members = std::make_tuple(member("host", &endpoint::host), member("port", &endpoint::port));
+};
+
+template<>
+struct luai::table_fields<service> {
+    static constexpr auto members = std::make_tuple(
+        member("name", &service::name), member("enabled", &service::enabled),
+        member("weight", &service::weight), member("primary", &service::primary),
+        member("replicas", &service::replicas), member("ports", &service::ports));
+};
+
+// a recursive shape, read as deep as the lua stack allows
+struct node {
+    long long v;
+    std::vector<node> kids;
+};
+
+template<>
+struct luai::table_fields<node> {
+    static constexpr auto members = std::make_tuple(member("v", &node::v), member("kids", &node::kids));
+};
+
 int main() {
     auto state = lua_interpreter{};
     state.openlibs();
@@ -78,6 +180,146 @@ int main() {
         a.get_index<types::TABLE>(5);
         ASSERT(a.len() == 5);
         ASSERT(a.get_index<types::LTYPE>(1) == types::INT);
+        SHOULD_THROW(a.to_vector<types::INT>());
+    }
+
+    // whole arrays at once
+    state.run_chunk(
+        "nums = { 1.5, 2.5, 3.5, 4.5 }\n"
+        "names = { 'a', 'b', 'c' }\n"
+    );
+    {
+        auto nums = state.get_global<types::TABLE>("nums");
+        auto v = nums.to_vector<types::NUM>();
+        ASSERT(v.size() == 4 && v[0] == 1.5 && v[3] == 4.5);
+        double buf[3] {};
+        ASSERT(nums.copy_into<types::NUM>(buf, 3) == 3);
+        ASSERT(buf[2] == 3.5);
+        double big[8] {};
+        ASSERT(nums.copy_into<types::NUM>(big, 8) == 4);
+        auto names = state.get_global<types::TABLE>("names");
+        ASSERT(names.to_vector<types::STR>() == (std::vector<std::string>{"a", "b", "c"}));
+        SHOULD_THROW(names.to_vector<types::NUM>());
+        ASSERT(names.len() == 3);
+    }
+
+    // iterating pairs
+    state.run_chunk(
+        "scores = { 10, 20, 30, alice = 1.5, bob = 'x', flag = true, sub = {}, [{}] = 'tkey' }\n"
+        "big = {} for i = 1, 1000 do big['k' .. i] = i end\n"
+        "empty = {}\n"
+    );
+    {
+        auto scores = state.get_global<types::TABLE>("scores");
+        auto seen = 0;
+        auto sum = 0ll;
+        for (auto &[key, value] : scores) {
+            ++seen;
+            if (key.type == types::INT)
+                sum += value.as<types::INT>();
+            else if (key.type == types::STR && key.string == "alice")
+                ASSERT(value.as<types::NUM>() == 1.5);
+            else if (key.type == types::STR && key.string == "bob")
+                ASSERT(value.as<types::STR>() == "x" && value.as<types::STRVIEW>() == "x");
+            else if (key.type == types::STR && key.string == "flag")
+                ASSERT(value.as<types::BOOL>());
+            else if (key.type == types::STR && key.string == "sub")
+                ASSERT(value.type == types::TABLE);
+            else
+                ASSERT(key.type == types::TABLE && value.string == "tkey");
+        }
+        ASSERT(seen == 8 && sum == 60);
+        // the stack is left as it was
+        ASSERT(scores.get_index<types::INT>(2) == 20);
+        SHOULD_THROW(scores.begin()->value.as<types::BOOL>());
+
+        auto empty = state.get_global<types::TABLE>("empty");
+        ASSERT(empty.begin() == empty.end());
+
+        // iterators are independent
+        auto big = state.get_global<types::TABLE>("big");
+        auto it = big.begin();
+        for (auto i = 0; i < 100; ++i)
+            ++it;
+        auto copy = it;
+        auto key = std::string{it->key.string};
+        for (auto i = 0; i < 100; ++i)
+            ++it;
+        ASSERT(copy->key.string == key && copy != it);
+        ASSERT(std::distance(copy, big.end()) == 900);
+        ASSERT(std::distance(big.begin(), big.end()) == 1000);
+
+        // batches, including across tables and after a rewind
+        auto batch = table_batch{64};
+        auto total = 0ll;
+        auto fills = 0;
+        while (big.next_batch(batch)) {
+            ASSERT(batch.size() <= 64);
+            ++fills;
+            for (auto &pair : batch)
+                total += pair.value.integer;
+        }
+        ASSERT(fills == 16 && total == 500500);
+        ASSERT(!big.next_batch(batch));
+        batch.rewind();
+        ASSERT(big.next_batch(batch) && batch.size() == 64);
+        ASSERT(scores.next_batch(batch) && batch.size() == 8);
+        auto moved = std::move(batch);
+        auto found = false;
+        for (auto &pair : moved)
+            found = found || pair.value.string == "x";
+        ASSERT(found);
+        // the last key removed and swept by a rehash before the next fill
+        state.run_chunk("gone = {} for i = 1, 16 do gone['k' .. i] = i end");
+        auto gone = state.get_global<types::TABLE>("gone");
+        auto part = table_batch{4};
+        ASSERT(gone.next_batch(part) && part.size() == 4);
+        state.set_global("last", std::string{part[3].key.string});
+        state.run_chunk("gone[last] = nil for i = 1, 1000 do gone['n' .. i] = i end");
+        SHOULD_THROW(gone.next_batch(part));
+    }
+
+    // writing values and whole tables
+    {
+        auto s = lua_interpreter{};
+        s.set_global("i", 42);
+        s.set_global("f", 2.5);
+        s.set_global("yes", true);
+        s.set_global("lit", "literal");
+        s.set_global("str", std::string{"a\0b", 3});
+        s.set_global("nums", std::vector<long long>{1, 2, 3});
+        s.set_global("grid", std::vector<std::vector<double>>{{1.5}, {2.5, 3.5}});
+        s.set_global("ages", std::map<std::string, int>{{"ann", 30}, {"bob", 40}});
+        s.set_global("names", std::unordered_map<long long, std::string>{{10, "ten"}, {20, "twenty"}});
+        s.set_global("tri", shape{"tri", {{0, 0}, {1, 0}, {0, 1}}});
+        ASSERT(s.get_global<types::INT>("i") == 42);
+        ASSERT(s.get_global<types::NUM>("f") == 2.5);
+        ASSERT(s.get_global<types::BOOL>("yes"));
+        ASSERT(s.get_global<types::STR>("lit") == "literal");
+        ASSERT(s.get_global<types::STR>("str").size() == 3);
+        s.openlibs();
+        ASSERT(std::get<0>(s.run_chunk(
+            "assert(#nums == 3 and nums[3] == 3 and math.type(nums[1]) == 'integer')\n"
+            "assert(#grid == 2 and grid[2][2] == 3.5)\n"
+            "assert(ages.ann == 30 and ages.bob == 40)\n"
+            "assert(names[10] == 'ten' and names[20] == 'twenty')\n"
+            "assert(tri.name == 'tri' and #tri.points == 3 and tri.points[3].y == 1)\n"
+        )));
+        {
+            auto tri = s.get_global<types::TABLE>("tri");
+            tri.set_field("name", "triangle");
+            tri.set_field("origin", point{5, 6});
+            auto points = tri.get_field<types::TABLE>("points");
+            points.set_index(4, point{1, 1});
+            ASSERT(points.len() == 4);
+            // the stack is unchanged when building throws
+            SHOULD_THROW_ANY(tri.set_field("bad", broken{}));
+            SHOULD_THROW_ANY(s.set_global("bad", broken{}));
+            ASSERT(points.get_index<types::TABLE>(4).get_field<types::NUM>("x") == 1);
+        }
+        ASSERT(std::get<0>(s.run_chunk(
+            "assert(tri.name == 'triangle' and tri.origin.y == 6 and tri.bad == nil and bad == nil)"
+        )));
     }
 
     state.run_chunk(
@@ -139,12 +381,101 @@ int main() {
         ASSERT(k.get_field<types::NUM>("spam") == 8.8);
     }
 
+    // several fields in one pass
+    {
+        auto k = state.get_global<types::TABLE>("k");
+        auto row = k.get_fields<types::INT, types::NUM, types::LTYPE>({"haha", "spam", "hehe"});
+        ASSERT(std::get<0>(row) == 8);
+        ASSERT(std::get<1>(row) == 8.8);
+        ASSERT(std::get<2>(row) == types::TABLE);
+        SHOULD_THROW((k.get_fields<types::INT, types::STR>({"nope", "spam"})));
+        auto msg = std::string{};
+        try {
+            k.get_fields<types::STR, types::INT, types::BOOL>({"haha", "spam", "nope"});
+        } catch (luastate_error &e) {
+            msg = e.what();
+        }
+        ASSERT(msg.find("[spam]") != std::string::npos && msg.find("[nope]") != std::string::npos);
+        ASSERT(msg.find("[haha]") == std::string::npos);
+        ASSERT(k.get_field<types::INT>("haha") == 8);
+    }
+
+    // table references outlive scopes
+    {
+        auto refs = std::vector<table_ref>{};
+        {
+            auto k = state.get_global<types::TABLE>("k");
+            auto kk = k.get_field<types::TABLE>("hehe").get_field<types::TABLE>("kk");
+            refs.emplace_back(kk.to_ref());
+            refs.emplace_back(k.to_ref());
+        }
+        ASSERT(refs[0].get_field<types::INT>("cc") == 10);
+        ASSERT(refs[0].get_index<types::BOOL>(16) == true);
+        ASSERT(refs[1].get_field<types::NUM>("spam") == 8.8);
+        SHOULD_THROW(refs[1].get_field<types::INT>("spam"));
+        auto moved = std::move(refs[1]);
+        ASSERT(moved.get_field<types::LTYPE>("hehe") == types::TABLE);
+        {
+            auto hehe = moved.push().get_field<types::TABLE>("hehe");
+            ASSERT(hehe.get_field<types::INT>("wow") == 9);
+        }
+        ASSERT(state.get_global<types::INT>("x") == 15);
+    }
+
     // short hand
     ASSERT(state.get_global<types::TABLE>("k")
             .get_field<types::TABLE>("hehe")
             .get_field<types::TABLE>("kk")
             .get_index<types::BOOL>(16) == true);
 
+    // compiled chunk cache
+    {
+        ASSERT(std::get<0>(state.run_cached("cnt = (cnt or 0) + 1")) == true);
+        ASSERT(std::get<0>(state.run_cached("cnt = (cnt or 0) + 1")) == true);
+        ASSERT(state.get_global<types::INT>("cnt") == 2);
+        auto stats = state.get_chunk_cache_stats();
+        ASSERT(stats.hits == 1 && stats.misses == 1 && stats.entries == 1);
+        auto chunk = state.load_chunk("cnt = cnt * 10");
+        ASSERT(std::get<0>(state.run_chunk(chunk)) == true);
+        ASSERT(std::get<0>(state.run_chunk(chunk)) == true);
+        ASSERT(state.get_global<types::INT>("cnt") == 200);
+        SHOULD_THROW(state.load_chunk("cnt = = 1"));
+        ASSERT(std::get<0>(state.run_cached("error('oops')")) == false);
+        // handle outlives eviction
+        state.set_chunk_cache_limit(0);
+        stats = state.get_chunk_cache_stats();
+        ASSERT(stats.entries == 0 && stats.bytes == 0);
+        ASSERT(std::get<0>(state.run_chunk(chunk)) == true);
+        ASSERT(state.get_global<types::INT>("cnt") == 2000);
+        auto other = lua_interpreter{};
+        ASSERT(std::get<0>(other.run_chunk(chunk)) == false);
+        state.set_chunk_cache_limit(1 << 20);
+    }
+
+    // chunks persisted on disk, only loaded for the source they were compiled from
+    {
+        namespace fs = std::filesystem;
+        auto dumped = [](const char *dir, const char *code) {
+            fs::create_directory(dir);
+            auto s = lua_interpreter{};
+            s.set_chunk_cache_dir(dir);
+            ASSERT(std::get<0>(s.run_cached(code)));
+            return fs::directory_iterator{dir}->path();
+        };
+        auto one = dumped("demo_test_chunks_1", "v = 1");
+        auto two = dumped("demo_test_chunks_2", "v = 2");
+        // another source of the same length under the name of "v = 1"
+        fs::copy_file(two, one, fs::copy_options::overwrite_existing);
+        for (auto dir : {"demo_test_chunks_1", "demo_test_chunks_2"}) {
+            auto s = lua_interpreter{};
+            s.set_chunk_cache_dir(dir);
+            ASSERT(std::get<0>(s.run_cached("v = 1")) && s.get_global<types::INT>("v") == 1);
+            ASSERT(std::get<0>(s.run_cached("v = 2")) && s.get_global<types::INT>("v") == 2);
+        }
+        fs::remove_all("demo_test_chunks_1");
+        fs::remove_all("demo_test_chunks_2");
+    }
+
     // move
     auto state2 = std::move(state);
     ASSERT(state2.get_global<types::INT>("x") == 15);
@@ -154,6 +485,546 @@ int main() {
         ASSERT(k2.get_field<types::NUM>("spam") == 8.8);
     }
 
+    // pool of states on worker threads
+    {
+        auto pool = interpreter_pool{4, {"base = 40", "function inc(n) return n + 1 end"}};
+        ASSERT(pool.size() == 4);
+        auto results = std::vector<std::future<long long>>{};
+        for (auto i = 0; i < 100; ++i)
+            results.emplace_back(pool.submit([](lua_interpreter &s) {
+                s.run_cached("r = inc(base) + 1");
+                return s.get_global<types::INT>("r");
+            }));
+        for (auto &r : results)
+            ASSERT(r.get() == 42);
+        ASSERT(std::get<0>(pool.submit_chunk("assert(base == 40)").get()) == true);
+        ASSERT(std::get<0>(pool.submit_chunk("error('x')").get()) == false);
+        auto bad = pool.submit([](lua_interpreter &s) { return s.get_global<types::INT>("nope"); });
+        SHOULD_THROW(bad.get());
+        SHOULD_THROW(interpreter_pool(2, {"error('bad bootstrap')"}));
+    }
+
+    // c++ functions called from lua
+    {
+        auto s = lua_interpreter{};
+        s.openlibs();
+        s.register_function("add", [](int a, int b) { return a + b; });
+        s.register_function("greet", [](const std::string &who) { return "hello " + who; });
+        s.register_function("divmod", [](long long a, long long b) { return std::make_tuple(a / b, a % b); });
+        auto seen = std::make_shared<std::vector<double>>();
+        s.register_function("record", [seen](double v) { seen->push_back(v); });
+        s.register_function("fail", [](bool) -> bool { throw std::runtime_error{"from c++"}; });
+        ASSERT(std::get<0>(s.run_chunk(
+            "x = add(40, 2)\n"
+            "g = greet('lua')\n"
+            "q, r = divmod(17, 5)\n"
+            "record(1.5) record(2)\n"
+        )) == true);
+        ASSERT(s.get_global<types::INT>("x") == 42);
+        ASSERT(s.get_global<types::STR>("g") == "hello lua");
+        ASSERT(s.get_global<types::INT>("q") == 3 && s.get_global<types::INT>("r") == 2);
+        ASSERT(seen->size() == 2 && (*seen)[1] == 2.0);
+        auto ret = s.run_chunk("add(1, 'x')");
+        ASSERT(std::get<0>(ret) == false && std::get<1>(ret).find("bad argument #2") != std::string::npos);
+        ret = s.run_chunk("fail(true)");
+        ASSERT(std::get<0>(ret) == false && std::get<1>(ret).find("from c++") != std::string::npos);
+        ASSERT(std::get<0>(s.run_chunk("ok = not pcall(add)")) == true);
+        ASSERT(s.get_global<types::BOOL>("ok") == true);
+        // integers that do not fit the parameter or lua are errors, not narrowed
+        s.register_function("as_unsigned", [](unsigned v) { return v; });
+        s.register_function("as_int", [](int v) { return v; });
+        s.register_function("too_big", [] { return ~0ull; });
+        ret = s.run_chunk("as_unsigned(-1)");
+        ASSERT(!std::get<0>(ret) && std::get<1>(ret).find("bad argument #1 (number out of range)") != std::string::npos);
+        ASSERT(!std::get<0>(s.run_chunk("as_int(1 << 40)")) && !std::get<0>(s.run_chunk("too_big()")));
+        ASSERT(std::get<0>(s.run_chunk("assert(as_unsigned(4294967295) == 4294967295 and as_int(-7) == -7)")));
+        SHOULD_THROW(s.set_global("huge", ~0ull));
+        // callables aligned beyond what lua gives userdata
+        struct alignas(64) wide { long long v; };
+        s.register_function("aligned", [w = wide{7}]() {
+            return reinterpret_cast<std::uintptr_t>(&w) % 64 == 0 ? w.v : 0;
+        });
+        ASSERT(std::get<0>(s.run_chunk("y = aligned()")) && s.get_global<types::INT>("y") == 7);
+        // lua owns the callable
+        ASSERT(seen.use_count() == 2);
+        s.run_chunk("record = nil collectgarbage()");
+        ASSERT(seen.use_count() == 1);
+    }
+
+    // lua functions called from c++
+    {
+        auto s = lua_interpreter{};
+        s.openlibs();
+        s.run_chunk(
+            "function score(x, w) return x * w end\n"
+            "function split(s) return s:sub(1, 1), #s, s:upper() end\n"
+            "function boom() error('boom') end\n"
+            "lib = { twice = function(n) return n * 2 end, [1] = function() return true end }\n"
+            "not_a_function = 5\n"
+        );
+        auto score = s.get_global<types::FUNC>("score");
+        ASSERT(score.call<types::NUM>(1.5, 4) == 6.0);
+        ASSERT(score.call<types::INT>(6, 7) == 42);
+        auto parts = s.get_global<types::FUNC>("split").call<types::STR, types::INT, types::STR>("hey");
+        ASSERT(std::get<0>(parts) == "h" && std::get<1>(parts) == 3 && std::get<2>(parts) == "HEY");
+        auto boom = s.get_global<types::FUNC>("boom");
+        SHOULD_THROW(boom.call<>());
+        SHOULD_THROW(score.call<types::BOOL>(1, 2));
+        SHOULD_THROW(s.get_global<types::FUNC>("not_a_function"));
+        ASSERT(s.get_global<types::LTYPE>("score") == types::FUNC);
+        {
+            auto lib = s.get_global<types::TABLE>("lib");
+            auto twice = lib.get_field<types::FUNC>("twice");
+            ASSERT(lib.get_index<types::FUNC>(1).call<types::BOOL>() == true);
+            // the handle outlives the table handle
+            score = twice;
+        }
+        ASSERT(score.call<types::INT>(21) == 42);
+        // the stack is balanced after failures
+        for (auto i = 0; i < 100000; ++i)
+            SHOULD_THROW(boom.call<types::INT>(i));
+        ASSERT(score.call<types::INT>(1) == 2);
+    }
+
+    // scripts from files and streams
+    {
+        auto s = lua_interpreter{};
+        s.openlibs();
+        {
+            auto out = std::ofstream{"demo_test_chunk.lua"};
+            out << "#!/usr/bin/env lua\nfrom_file = 0\nfor i = 1, 100 do from_file = from_file + i end\n";
+        }
+        ASSERT(std::get<0>(s.run_file("demo_test_chunk.lua")) == true);
+        ASSERT(s.get_global<types::INT>("from_file") == 5050);
+        // precompiled
+        ASSERT(std::get<0>(s.run_chunk(
+            "local f = io.open('demo_test_chunk.luac', 'wb')\n"
+            "f:write(string.dump(load('from_bytecode = 7')))\n"
+            "f:close()\n"
+        )) == true);
+        ASSERT(std::get<0>(s.run_file("demo_test_chunk.luac")) == true);
+        ASSERT(s.get_global<types::INT>("from_bytecode") == 7);
+        ASSERT(std::get<0>(s.run_file("demo_test_no_such_file.lua")) == false);
+        {
+            auto out = std::ofstream{"demo_test_chunk.lua"};
+            out << "x = 1\nerror('line two')\n";
+        }
+        auto ret = s.run_file("demo_test_chunk.lua");
+        ASSERT(std::get<0>(ret) == false && std::get<1>(ret).find("demo_test_chunk.lua:2:") != std::string::npos);
+        std::remove("demo_test_chunk.lua");
+        std::remove("demo_test_chunk.luac");
+
+        // tiny blocks split tokens across reads
+        auto in = std::istringstream{"streamed = { 'abc', 'defgh' }\nstreamed_n = #streamed[2] + 1000000\n"};
+        ASSERT(std::get<0>(s.run_stream(in, "=test", 3)) == true);
+        ASSERT(s.get_global<types::INT>("streamed_n") == 1000005);
+        auto bad = std::istringstream{"streamed = = 1"};
+        ret = s.run_stream(bad, "=bad");
+        ASSERT(std::get<0>(ret) == false && std::get<1>(ret).find("bad:1:") != std::string::npos);
+    }
+
+    // strings without copies
+    {
+        auto s = lua_interpreter{};
+        s.openlibs();
+        s.run_chunk(
+            "bin = 'a\\0b'\n"
+            "word = 'hello'\n"
+            "num = 42\n"
+            "cfg = { name = 'svc', tags = { 'x', 'y' } }\n"
+            "function pair() return 'left', 'right' end\n"
+        );
+        // binary safe
+        ASSERT(s.get_global<types::STR>("bin") == std::string("a\0b", 3));
+        SHOULD_THROW(s.get_global<types::STRVIEW>("word"));
+        {
+            auto guard = view_guard{s};
+            auto word = s.get_global<types::STRVIEW>("word");
+            auto bin = s.get_global<types::STRVIEW>("bin");
+            auto num = s.get_global<types::STRVIEW>("num");
+            ASSERT(bin == std::string_view("a\0b", 3));
+            ASSERT(num == "42");
+            auto cfg = s.get_global<types::TABLE>("cfg");
+            auto name = cfg.get_field<types::STRVIEW>("name");
+            auto tag = cfg.get_field<types::TABLE>("tags").get_index<types::STRVIEW>(2);
+            auto row = cfg.get_fields<types::STRVIEW, types::LTYPE>({"name", "tags"});
+            auto pair = s.get_global<types::FUNC>("pair").call<types::STRVIEW, types::STRVIEW>();
+            {
+                auto inner = view_guard{s};
+                ASSERT(cfg.to_ref().get_field<types::STRVIEW>("name") == "svc");
+            }
+            // the strings stay alive even if nothing refers to them anymore
+            s.run_chunk("word = nil cfg.name = nil cfg.tags = nil pair = nil collectgarbage() collectgarbage()");
+            s.run_chunk("local t = {} for i = 1, 10000 do t[i] = 'garbage' .. i end");
+            ASSERT(word == "hello" && name == "svc" && tag == "y" && std::get<0>(row) == "svc");
+            ASSERT(std::get<0>(pair) == "left" && std::get<1>(pair) == "right");
+            // reading the same string again does not anchor it again
+            auto before = s.get_alloc_stats().bytes_in_use;
+            for (auto i = 0; i < 10000; ++i)
+                s.get_global<types::STRVIEW>("bin");
+            ASSERT(s.get_alloc_stats().bytes_in_use < before + 1024);
+        }
+        SHOULD_THROW(s.get_global<types::STRVIEW>("bin"));
+        s.register_function("count_a", [](std::string_view str) {
+            return static_cast<long long>(std::count(str.begin(), str.end(), 'a'));
+        });
+        ASSERT(std::get<0>(s.run_chunk("na = count_a('banana')")) == true);
+        ASSERT(s.get_global<types::INT>("na") == 3);
+    }
+
+    // custom allocators
+    {
+        auto pool = std::make_shared<pool_allocator>();
+        auto s = lua_interpreter{pool};
+        s.openlibs();
+        ASSERT(std::get<0>(s.run_chunk("t = {} for i = 1, 1000 do t[i] = { i, tostring(i) } end")) == true);
+        ASSERT(s.get_global<types::TABLE>("t").get_index<types::TABLE>(1000).get_index<types::STR>(2) == "1000");
+        auto stats = s.get_alloc_stats();
+        ASSERT(stats.allocations > 1000 && stats.bytes_in_use > 0 && stats.peak_bytes >= stats.bytes_in_use);
+        ASSERT(pool->slab_bytes() > 0);
+
+        auto arena = std::make_shared<arena_allocator>(1 << 16);
+        auto r = lua_interpreter{arena};
+        auto chunk = r.load_chunk("x = 1");
+        for (auto i = 0; i < 3; ++i) {
+            r.openlibs();
+            // overflows the arena, falls back to malloc
+            ASSERT(std::get<0>(r.run_chunk("t = {} for i = 1, 10000 do t[i] = 'v' .. i end x = #t")) == true);
+            ASSERT(r.get_global<types::INT>("x") == 10000);
+            r.reset();
+            ASSERT(r.get_global<types::LTYPE>("x") == types::NIL);
+        }
+        ASSERT(std::get<0>(r.run_chunk(chunk)) == false);
+        ASSERT(r.get_alloc_stats().frees > 0);
+    }
+
+    // execution budgets
+    {
+        auto s = lua_interpreter{};
+        s.openlibs();
+        auto ok = s.run_chunk("x = 0 for i = 1, 1000 do x = x + i end", exec_budget{100000});
+        ASSERT(std::get<0>(ok) && std::get<2>(ok) == budget_error::NONE && s.get_global<types::INT>("x") == 500500);
+        auto spin = s.run_chunk("while true do end", exec_budget{1000000});
+        ASSERT(!std::get<0>(spin) && std::get<2>(spin) == budget_error::INSTRUCTIONS);
+        ASSERT(std::get<1>(spin) == "instruction budget exceeded");
+        // the script cannot swallow it
+        auto swallow = s.run_chunk("while true do pcall(function() while true do end end) end", exec_budget{1000000});
+        ASSERT(std::get<2>(swallow) == budget_error::INSTRUCTIONS);
+        auto co = s.run_chunk("co = coroutine.wrap(function() while true do end end) co()", exec_budget{1000000});
+        ASSERT(std::get<2>(co) == budget_error::INSTRUCTIONS);
+        auto timed = s.run_chunk("while true do end", exec_budget{0, std::chrono::milliseconds{20}});
+        ASSERT(!std::get<0>(timed) && std::get<2>(timed) == budget_error::WALL_TIME);
+        auto hungry = s.run_chunk("t = {} for i = 1, 10000000 do t[i] = i end", exec_budget{0, {}, 1 << 20});
+        ASSERT(!std::get<0>(hungry) && std::get<2>(hungry) == budget_error::MEMORY);
+        // garbage churn close to the cap is collected, a caught memory error is not a hit
+        auto churn = s.run_chunk("keep = string.rep('k', 100000)\n"
+                                 "for i = 1, 50 do local s = string.rep('x', 30000 + i) end done = true",
+                                 exec_budget{0, {}, 256 << 10});
+        ASSERT(std::get<0>(churn) && std::get<2>(churn) == budget_error::NONE && s.get_global<types::BOOL>("done"));
+        auto recovered = s.run_chunk("local ok = pcall(string.rep, 'x', 1 << 24) assert(not ok) keep = nil",
+                                     exec_budget{0, {}, 256 << 10});
+        ASSERT(std::get<0>(recovered) && std::get<2>(recovered) == budget_error::NONE);
+        // a plain error is not a budget error
+        auto failed = s.run_chunk("error('plain')", exec_budget{1000000});
+        ASSERT(!std::get<0>(failed) && std::get<2>(failed) == budget_error::NONE);
+        // reusable, without a hook
+        ASSERT(std::get<0>(s.run_chunk("t = nil collectgarbage() assert(debug.gethook() == nil) co = nil")));
+        ASSERT(std::get<0>(s.run_chunk("t = {} for i = 1, 100000 do t[i] = i end")));
+        auto chunk = s.load_chunk("local n = 0 while n >= 0 do n = n + 1 end");
+        ASSERT(std::get<2>(s.run_chunk(chunk, exec_budget{50000, {}, 0, 100})) == budget_error::INSTRUCTIONS);
+    }
+
+    // scripts as coroutines
+    {
+        auto s = lua_interpreter{};
+        s.openlibs();
+        auto sched = script_scheduler{s};
+        // a fake i/o source, completed by hand
+        auto pending = std::vector<std::pair<async_call, std::string>>{};
+        sched.register_async("fetch", [&](async_call call, std::string key) {
+            pending.emplace_back(std::move(call), std::move(key));
+        });
+        sched.register_async("sleep", [&](async_call call, long long ms) {
+            sched.after(std::chrono::milliseconds{ms}, [call]() mutable { call.complete(); });
+        });
+        sched.register_async("now_or_never", [](async_call call, bool now) {
+            if (now)
+                call.complete("now", 1);
+            else
+                throw std::runtime_error{"never"};
+        });
+        s.run_chunk("log = {}");
+        auto a = sched.spawn("local v = fetch('a') log[#log + 1] = v");
+        auto b = sched.spawn("local v, n = fetch('b') log[#log + 1] = v .. n");
+        auto c = sched.spawn("local ok, err = pcall(fetch, 'c') assert(not ok) error('c: ' .. err)");
+        auto d = sched.spawn("local s, n = now_or_never(true) assert(s == 'now' and n == 1)"
+                             " assert(not pcall(now_or_never, false))");
+        auto e = sched.spawn("for i = 1, 3 do coroutine.yield() end");
+        auto bad = sched.spawn("this is not lua");
+        ASSERT(!std::get<0>(bad.get()));
+        ASSERT(sched.in_flight() == 5);
+        ASSERT(sched.poll() == 5 && pending.size() == 3);
+        // completed in a different order than started
+        pending[1].first.complete("B", 2);
+        pending[0].first.complete("A");
+        pending[0].first.complete("twice"); // ignored
+        pending[2].first.fail("refused");
+        while (sched.in_flight())
+            sched.poll();
+        ASSERT(std::get<0>(a.get()) && std::get<0>(b.get()) && std::get<0>(d.get()) && std::get<0>(e.get()));
+        auto cres = c.get();
+        ASSERT(!std::get<0>(cres) && std::get<1>(cres).find("c: refused") != std::string::npos);
+        {
+            auto log = s.get_global<types::TABLE>("log");
+            ASSERT(log.get_index<types::STR>(1) == "B2" && log.get_index<types::STR>(2) == "A");
+        }
+        // not from a plain chunk
+        ASSERT(!std::get<0>(s.run_chunk("fetch('x')")));
+
+        // a script that catches a throwing async function keeps running
+        auto caught = sched.spawn("assert(not pcall(now_or_never, false)) coroutine.yield() caught = true");
+        // results that cannot be pushed fail the call with the message
+        sched.register_async("unpushable", [](async_call call) { call.complete(broken{}); });
+        auto failed = sched.spawn("local ok, err = pcall(unpushable) assert(not ok and err:find('broken'))");
+        // more results than a c function has stack room for
+        sched.register_async("wide", [](async_call call) {
+            std::apply([&](auto ...value) { call.complete(value...); }, std::array<int, 60>{});
+        });
+        auto wide = sched.spawn("assert(select('#', wide()) == 60)");
+        for (auto i = 0; i < 100 && sched.in_flight(); ++i)
+            sched.poll();
+        ASSERT(sched.in_flight() == 0 && s.get_global<types::BOOL>("caught"));
+        ASSERT(std::get<0>(wide.get()));
+        ASSERT(std::get<0>(caught.get()) && std::get<0>(failed.get()));
+
+        // many scripts waiting on timers and on completions from another thread
+        auto results = std::vector<std::future<std::tuple<bool, std::string>>>{};
+        for (auto i = 0; i < 1000; ++i)
+            results.emplace_back(sched.spawn("sleep(1) sleep(2) total = (total or 0) + 1"));
+        std::vector<async_call> remote;
+        sched.register_async("remote", [&](async_call call) { remote.emplace_back(std::move(call)); });
+        auto r = sched.spawn("assert(remote() == 42)");
+        while (remote.empty())
+            sched.poll();
+        auto completer = std::thread{[call = remote.front()]() mutable { call.complete(42); }};
+        sched.run();
+        completer.join();
+        ASSERT(std::get<0>(r.get()));
+        for (auto &result : results)
+            ASSERT(std::get<0>(result.get()));
+        ASSERT(s.get_global<types::INT>("total") == 1000);
+    }
+
+    // lookups without exceptions
+    {
+        auto s = lua_interpreter{};
+        s.run_chunk("port = 8080 host = 'local' cfg = { name = 'svc', retries = 3, 'first', true }");
+        auto port = s.try_get_global<types::INT>("port");
+        ASSERT(port && *port == 8080 && port.error() == lookup_error::NONE);
+        auto absent = s.try_get_global<types::INT>("timeout");
+        ASSERT(!absent && absent.error() == lookup_error::MISSING && absent.found() == types::NIL);
+        ASSERT(absent.value_or(30) == 30);
+        auto mistyped = s.try_get_global<types::BOOL>("host");
+        ASSERT(mistyped.error() == lookup_error::WRONG_TYPE && mistyped.found() == types::STR);
+        // the same message as the throwing getter
+        try {
+            s.get_global<types::BOOL>("host");
+            ASSERT(false);
+        } catch (luastate_error &e) {
+            ASSERT(mistyped.message() == e.what());
+        }
+        SHOULD_THROW(mistyped.value());
+        {
+            auto cfg = s.get_global<types::TABLE>("cfg");
+            ASSERT(cfg.try_get_field<types::STR>("name").value() == "svc");
+            ASSERT(cfg.try_get_field<types::NUM>("retries").value_or(0) == 3);
+            ASSERT(cfg.try_get_field<types::STR>("missing").value_or("none") == "none");
+            ASSERT(*cfg.try_get_index<types::STR>(1) == "first" && *cfg.try_get_index<types::BOOL>(2));
+            auto third = cfg.try_get_index<types::INT>(3);
+            ASSERT(third.error() == lookup_error::MISSING && third.message() == "variable/field [3] is not integer");
+            auto guard = view_guard{s};
+            ASSERT(*cfg.try_get_field<types::STRVIEW>("name") == "svc");
+            auto ref = cfg.to_ref();
+            ASSERT(*ref.try_get_field<types::INT>("retries") == 3 && !ref.try_get_index<types::INT>(1));
+            ASSERT(cfg.len() == 2);
+        }
+    }
+
+    // tables as structs
+    {
+        auto s = lua_interpreter{};
+        s.run_chunk(
+            "svc = { name = 'api', enabled = true, weight = 0.5,\n"
+            "  primary = { host = 'a', port = 80 },\n"
+            "  replicas = { { host = 'b', port = 81 }, { host = 'c', port = 82 } },\n"
+            "  ports = { 1, 2, 3 } }\n"
+            "bad = { name = 'x', enabled = true, weight = 1, primary = { host = 'a', port = 1 },\n"
+            "  replicas = { { host = 'b', port = 2 }, { host = 'c', port = 'oops' } }, ports = {} }\n"
+        );
+        auto svc = s.get_global<types::TABLE>("svc").as<service>();
+        ASSERT(svc.name == "api" && svc.enabled && svc.weight == 0.5);
+        ASSERT(svc.primary.host == "a" && svc.primary.port == 80);
+        ASSERT(svc.replicas.size() == 2 && svc.replicas[1].host == "c" && svc.replicas[1].port == 82);
+        ASSERT(svc.ports == (std::vector<long long>{1, 2, 3}));
+        try {
+            s.get_global<types::TABLE>("bad").as<service>();
+            ASSERT(false);
+        } catch (luastate_error &e) {
+            ASSERT(std::string{e.what()} == "variable/field [replicas][2][port] is not integer");
+        }
+        // round trip through push
+        svc.name = "copy";
+        svc.replicas.push_back({"d", 83});
+        s.set_global("svc2", svc);
+        {
+            auto frame = s.frame_global("svc2");
+            auto back = frame.as<service>();
+            ASSERT(back.name == "copy" && back.replicas.size() == 3 && back.replicas[2].port == 83);
+            ASSERT(back.primary.host == "a" && back.ports.size() == 3);
+        }
+        // numbers that do not fit the member
+        s.run_chunk("wide = { host = 'a', port = 4294967376 } neg = { 255, -1 }");
+        try {
+            s.get_global<types::TABLE>("wide").as<endpoint>();
+            ASSERT(false);
+        } catch (luastate_error &e) {
+            ASSERT(std::string{e.what()} == "variable/field [port] is out of range");
+        }
+        try {
+            s.get_global<types::TABLE>("neg").as<std::vector<unsigned char>>();
+            ASSERT(false);
+        } catch (luastate_error &e) {
+            ASSERT(std::string{e.what()} == "variable/field [2] is out of range");
+        }
+        // nesting deeper than the stack lua starts with
+        s.run_chunk("deep = { v = 0, kids = {} } do local cur = deep for d = 1, 5000 do\n"
+                    "  local kid = { v = d, kids = {} } cur.kids[1] = kid cur = kid end end");
+        auto deep = s.get_global<types::TABLE>("deep").as<node>();
+        auto depth = 0;
+        for (auto *cur = &deep; !cur->kids.empty(); cur = &cur->kids[0])
+            ++depth;
+        ASSERT(depth == 5000);
+        // the stack is left as it was
+        ASSERT(s.get_global<types::TABLE>("svc2").get_field<types::TABLE>("primary").get_field<types::INT>("port") == 80);
+    }
+
+    // stack frames
+    {
+        auto s = lua_interpreter{};
+        s.run_chunk("config = { service = { limits = { rate = 42, 'a', 'b' }, name = 'svc' } }");
+        {
+            auto config = s.frame_global("config");
+            auto service = config.frame_field("service");
+            {
+                auto limits = service.frame_field("limits");
+                ASSERT(limits.get_field<types::INT>("rate") == 42 && limits.len() == 2);
+                ASSERT(limits.get_index<types::STR>(2) == "b" && !limits.try_get_index<types::STR>(3));
+                limits.set_field("burst", 10);
+                limits.set_index(3, "c");
+                SHOULD_THROW(limits.get_field<types::STR>("missing"));
+                SHOULD_THROW(limits.frame_field("rate"));
+                auto row = limits.get_fields<types::INT, types::INT>({"rate", "burst"});
+                ASSERT(std::get<0>(row) == 42 && std::get<1>(row) == 10);
+                SHOULD_THROW((limits.get_fields<types::INT, types::STR>({"rate", "missing"})));
+                ASSERT((limits.to_vector<types::STR>() == std::vector<std::string>{"a", "b", "c"}));
+                std::string first[2];
+                ASSERT(limits.copy_into<types::STR>(first, 2) == 2 && first[1] == "b");
+            }
+            // the parent is usable again once the child is gone
+            ASSERT(service.get_field<types::STR>("name") == "svc");
+            ASSERT(*service.try_get_field<types::STR>("name") == "svc");
+            auto moved = std::move(service);
+            ASSERT(moved.frame_field("limits").get_field<types::INT>("burst") == 10);
+            // frames and handles stack on each other
+            auto handle = s.get_global<types::TABLE>("config");
+            auto inner = moved.frame_field("limits");
+            ASSERT(handle.get_field<types::TABLE>("service").get_field<types::STR>("name") == "svc");
+            ASSERT(inner.get_index<types::STR>(1) == "a");
+        }
+        SHOULD_THROW(s.frame_global("nothing"));
+        s.run_chunk("ok = config.service.limits.burst == 10 and config.service.limits[3] == 'c'");
+        ASSERT(s.get_global<types::BOOL>("ok"));
+    }
+
+    // restoring the globals of a warm state
+    {
+        auto s = lua_interpreter{};
+        SHOULD_THROW(s.restore_globals());
+        s.openlibs();
+        s.run_chunk("config = { limit = 10, a = { b = { c = 1 } } } function greet(n) return 'hi ' .. n end\n"
+                    "shared = { inner = { v = 1 } } for k = 1, 16 do _G['alias' .. k] = { shared = shared } end");
+        s.snapshot_globals();
+        auto request = [&](const char *code) {
+            auto ret = s.run_chunk(code);
+            s.restore_globals();
+            return std::get<0>(ret);
+        };
+        ASSERT(request(
+            "leaked = 1 config = nil greet = print string.evil = true string.upper = nil\n"
+            "package.loaded.fake = {} setmetatable(_G, { __index = function() return 0 end })\n"
+        ));
+        ASSERT(request(
+            "assert(leaked == nil and string.evil == nil and string.upper('a') == 'A')\n"
+            "assert(config.limit == 10 and greet('x') == 'hi x')\n"
+            "assert(package.loaded.fake == nil and getmetatable(_G) == nil)\n"
+        ));
+        // nested deeper than the snapshot: not undone
+        ASSERT(request("config.limit = 11 config.a.b.c = 2"));
+        ASSERT(std::get<0>(s.run_chunk("assert(config.limit == 10 and config.a.b.c == 2)")));
+        // reached both through a global and one level deeper, restored from the shallower
+        ASSERT(request("shared.inner.v = 2"));
+        ASSERT(std::get<0>(s.run_chunk("assert(shared.inner.v == 1)")));
+        // a failed request is cleaned up the same
+        ASSERT(!request("leaked = 2 error('boom')"));
+        ASSERT(s.get_global<types::LTYPE>("leaked") == types::NIL);
+        s.reset();
+        SHOULD_THROW(s.restore_globals());
+    }
+
+    // instrumentation
+    {
+        auto s = lua_interpreter{};
+        s.openlibs();
+#ifdef LUAI_INSTRUMENT
+        s.register_function("twice", [](long long x) { return x * 2; });
+        s.run_chunk("x = twice(21) f = function(n) return n + 1 end t = { 1 }");
+        ASSERT(s.get_global<types::INT>("x") == 42);
+        SHOULD_THROW(s.get_global<types::STR>("t"));
+        ASSERT(s.get_global<types::FUNC>("f").call<types::INT>(1) == 2);
+        ASSERT(!std::get<0>(s.run_chunk("twice('no')")));
+        auto snap = s.get_instruments();
+        ASSERT(snap.enabled && snap.get_calls >= 3 && snap.type_errors == 2);
+        ASSERT(snap.native_calls == 2 && snap.function_calls == 1 && snap.chunk_runs >= 2);
+        ASSERT(snap.max_stack_depth >= 1 && snap.bytes_allocated > 0);
+        ASSERT(snap.run_chunk.count == snap.chunk_runs && snap.function_call.count == 1);
+        ASSERT(snap.run_chunk.quantile_ns(0.5) > 0 && snap.run_chunk.quantile_ns(1.0) <= snap.run_chunk.max_ns);
+
+        s.start_profiler(100);
+        s.run_chunk(
+            "local function spin()\n"
+            "  local n = 0\n"
+            "  for i = 1, 200000 do n = n + i end\n"
+            "  return n\n"
+            "end\n"
+            "spin()\n"
+        );
+        // the budget shares the hook with the profiler
+        auto spin = s.run_chunk("while true do end", exec_budget{100000});
+        ASSERT(std::get<2>(spin) == budget_error::INSTRUCTIONS);
+        s.stop_profiler();
+        snap = s.get_instruments();
+        ASSERT(!snap.hot_spots.empty() && snap.hot_spots.front().location.find(":3") != std::string::npos);
+        ASSERT(std::get<0>(s.run_chunk("assert(debug.gethook() == nil)")));
+        s.reset_instruments();
+        snap = s.get_instruments();
+        ASSERT(snap.get_calls == 0 && snap.hot_spots.empty() && snap.run_chunk.count == 0);
+#else
+        s.start_profiler();
+        ASSERT(std::get<0>(s.run_chunk("assert(debug.gethook() == nil)")));
+        ASSERT(!s.get_instruments().enabled);
+#endif
+    }
+
     state2.run_chunk(
         "print('bye!')\n"
     );
@@ -0,0 +1,189 @@
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "interpreter_pool.hxx"
+
+using namespace luai;
+
+struct interpreter_pool::impl {
+    struct worker {
+        lua_interpreter state;
+        // owner takes from the back, thieves from the front
+        std::mutex lock;
+        std::deque<std::unique_ptr<task>> tasks;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<worker>> workers;
+
+    // idle workers sleep here until something is queued
+    std::mutex idle_lock;
+    std::condition_variable idle_cv;
+    // number of queued tasks, changed together with a queue under its worker's lock
+    std::atomic<std::size_t> pending {0};
+    bool stopping {false};
+
+    // round robin target for tasks submitted from outside of the pool
+    std::atomic<std::size_t> next {0};
+
+    // worker index of the current thread, if it belongs to this pool
+    static thread_local impl *current_pool;
+    static thread_local std::size_t current_index;
+
+    impl(std::size_t nstates, const std::vector<std::string> &bootstrap) {
+        if (nstates == 0)
+            throw luastate_error{"interpreter pool needs at least one state"};
+        workers.reserve(nstates);
+        for (auto i = std::size_t{}; i < nstates; ++i) {
+            auto w = std::make_unique<worker>();
+            w->state.openlibs();
+            for (auto &chunk : bootstrap) {
+                auto ret = w->state.run_cached(chunk.c_str());
+                if (!std::get<0>(ret))
+                    throw luastate_error{"bootstrap chunk failed: " + std::get<1>(ret)};
+            }
+            w->state.snapshot_globals();
+            workers.emplace_back(std::move(w));
+        }
+        // only start threads once every state is ready, so that throwing above is safe.
+        // if starting one fails, the ones already running are stopped before unwinding
+        try {
+            for (auto i = std::size_t{}; i < nstates; ++i)
+                workers[i]->thread = std::thread{[this, i] { work(i); }};
+        } catch (...) {
+            stop();
+            throw;
+        }
+    }
+
+    impl(impl &&) = delete;
+    impl &operator=(impl &&) = delete;
+
+    void enqueue(std::unique_ptr<task> t) {
+        auto target = current_pool == this
+            ? current_index
+            : next.fetch_add(1, std::memory_order_relaxed) % workers.size();
+        {
+            auto &w = *workers[target];
+            std::lock_guard<std::mutex> guard{w.lock};
+            w.tasks.emplace_back(std::move(t));
+            ++pending;
+        }
+        // a worker between checking pending and sleeping holds idle_lock, so it cannot
+        // miss the notification
+        {
+            std::lock_guard<std::mutex> guard{idle_lock};
+        }
+        idle_cv.notify_one();
+    }
+
+    std::unique_ptr<task> pop_local(std::size_t index) {
+        auto &w = *workers[index];
+        std::lock_guard<std::mutex> guard{w.lock};
+        if (w.tasks.empty())
+            return nullptr;
+        auto t = std::move(w.tasks.back());
+        w.tasks.pop_back();
+        --pending;
+        return t;
+    }
+
+    // w.lock is held
+    std::unique_ptr<task> take_front(worker &w) {
+        if (w.tasks.empty())
+            return nullptr;
+        auto t = std::move(w.tasks.front());
+        w.tasks.pop_front();
+        --pending;
+        return t;
+    }
+
+    std::unique_ptr<task> steal(std::size_t thief) {
+        auto contended = false;
+        for (auto k = std::size_t{1}; k < workers.size(); ++k) {
+            auto &w = *workers[(thief + k) % workers.size()];
+            std::unique_lock<std::mutex> guard{w.lock, std::try_to_lock};
+            if (!guard) {
+                contended = true;
+                continue;
+            }
+            if (auto t = take_front(w))
+                return t;
+        }
+        if (!contended)
+            return nullptr;
+        // queues that were busy are waited for, so that the thief does not go back to
+        // sleep, or spin on pending, while they still hold tasks
+        for (auto k = std::size_t{1}; k < workers.size(); ++k) {
+            auto &w = *workers[(thief + k) % workers.size()];
+            std::lock_guard<std::mutex> guard{w.lock};
+            if (auto t = take_front(w))
+                return t;
+        }
+        return nullptr;
+    }
+
+    void work(std::size_t index) {
+        current_pool = this;
+        current_index = index;
+        auto &state = workers[index]->state;
+        while (true) {
+            auto t = pop_local(index);
+            if (!t)
+                t = steal(index);
+            if (t) {
+                t->run(state);
+                continue;
+            }
+            std::unique_lock<std::mutex> guard{idle_lock};
+            idle_cv.wait(guard, [this] { return stopping || pending > 0; });
+            if (stopping && pending == 0)
+                return;
+        }
+    }
+
+    // lets the workers drain their queues and joins them
+    void stop() noexcept {
+        {
+            std::lock_guard<std::mutex> guard{idle_lock};
+            stopping = true;
+        }
+        idle_cv.notify_all();
+        for (auto &w : workers)
+            if (w->thread.joinable())
+                w->thread.join();
+    }
+
+    ~impl() {
+        stop();
+    }
+};
+
+thread_local interpreter_pool::impl *interpreter_pool::impl::current_pool {nullptr};
+thread_local std::size_t interpreter_pool::impl::current_index {0};
+
+interpreter_pool::interpreter_pool(std::size_t nstates, const std::vector<std::string> &bootstrap)
+    : pimpl{std::make_unique<impl>(nstates, bootstrap)}
+{}
+
+interpreter_pool::~interpreter_pool() = default;
+
+interpreter_pool::interpreter_pool(interpreter_pool &&) noexcept = default;
+interpreter_pool &interpreter_pool::operator=(interpreter_pool &&) noexcept = default;
+
+void interpreter_pool::enqueue(std::unique_ptr<task> t) {
+    pimpl->enqueue(std::move(t));
+}
+
+std::future<std::tuple<bool, std::string>> interpreter_pool::submit_chunk(std::string code) {
+    return submit([code = std::move(code)](lua_interpreter &state) {
+        return state.run_cached(code.c_str());
+    });
+}
+
+std::size_t interpreter_pool::size() const noexcept {
+    return pimpl->workers.size();
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <future>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "lua_interpreter.hxx"
+
+namespace luai {
+
+// a fixed set of lua states, each owned by one worker thread
+// every state has its standard libraries opened and the bootstrap chunks run before
+// accepting any work. submitted tasks are queued on the workers and idle workers steal
+// from busy ones, so a task may run on any of the states
+//
+// a task receives the state it runs on. do not let anything obtained from it
+// (table handles, chunk handles...) escape the task. the globals of each state are
+// snapshotted after the bootstrap, a task may call restore_globals() to start clean
+class interpreter_pool {
+public:
+    // throws luastate_error if a bootstrap chunk fails on any state
+    explicit interpreter_pool(std::size_t nstates, const std::vector<std::string> &bootstrap = {});
+
+    // finishes all submitted tasks, then joins the workers
+    ~interpreter_pool();
+
+    // MOVE, COPYING DELETED
+    interpreter_pool(interpreter_pool &&) noexcept;
+    interpreter_pool &operator=(interpreter_pool &&) noexcept;
+
+    // runs f(lua_interpreter &) on one of the states
+    // exceptions thrown by f are stored in the future
+    template<class F>
+    auto submit(F &&f) -> std::future<std::invoke_result_t<std::decay_t<F> &, lua_interpreter &>>;
+
+    // runs a chunk through the chunk cache of one of the states
+    std::future<std::tuple<bool, std::string>> submit_chunk(std::string code);
+
+    std::size_t size() const noexcept;
+
+private:
+    // type erased unit of work
+    struct task {
+        virtual void run(lua_interpreter &) = 0;
+        virtual ~task() = default;
+    };
+
+    template<class R>
+    struct packaged : task {
+        std::packaged_task<R(lua_interpreter &)> work;
+        explicit packaged(std::packaged_task<R(lua_interpreter &)> &&w) : work{std::move(w)} {}
+        void run(lua_interpreter &state) override { work(state); }
+    };
+
+    void enqueue(std::unique_ptr<task>);
+
+    struct impl;
+    std::unique_ptr<impl> pimpl;
+};
+
+template<class F>
+auto interpreter_pool::submit(F &&f) -> std::future<std::invoke_result_t<std::decay_t<F> &, lua_interpreter &>> {
+    using R = std::invoke_result_t<std::decay_t<F> &, lua_interpreter &>;
+    auto work = std::packaged_task<R(lua_interpreter &)>{std::forward<F>(f)};
+    auto result = work.get_future();
+    enqueue(std::make_unique<packaged<R>>(std::move(work)));
+    return result;
+}
+
+} // namespace luai
@@ -1,3 +1,27 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <memory>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define LUAI_HAS_MMAP 1
+#endif
+
 #include "lua.hpp"
 
 #include "lua_interpreter.hxx"
@@ -34,18 +58,466 @@ namespace {
     auto operator+(const std::string &lhs, keytype_t<var_where::FUNC1>) {
         return lhs + "function()";
     }
+
+    // default bound of the chunk cache, in source bytes
+    constexpr std::size_t DEFAULT_CHUNK_CACHE_LIMIT {8u << 20};
+
+    // 64-bit FNV-1a, keys the chunk cache
+    std::uint64_t hash_source(const char *code, std::size_t len) noexcept {
+        auto hash = std::uint64_t{14695981039346656037u};
+        for (auto i = std::size_t{}; i < len; ++i) {
+            hash ^= static_cast<unsigned char>(code[i]);
+            hash *= 1099511628211u;
+        }
+        return hash;
+    }
+
+    // how a value on the stack is checked and converted for each basic type
+    template<types Type>
+    struct value_ops;
+
+    template<>
+    struct value_ops<types::INT> {
+        static const char *what() noexcept { return "integer"; }
+        static bool check(lua_State *L, int idx) noexcept { return lua_isinteger(L, idx); }
+        static LuaInt convert(lua_State *L, int idx) noexcept { return lua_tointegerx(L, idx, NULL); }
+    };
+
+    template<>
+    struct value_ops<types::NUM> {
+        static const char *what() noexcept { return "number or string convertible to number"; }
+        static bool check(lua_State *L, int idx) noexcept { return lua_isnumber(L, idx); }
+        static double convert(lua_State *L, int idx) noexcept { return lua_tonumberx(L, idx, NULL); }
+    };
+
+    template<>
+    struct value_ops<types::STR> {
+        static const char *what() noexcept { return "string or number"; }
+        static bool check(lua_State *L, int idx) noexcept { return lua_isstring(L, idx); }
+        static std::string convert(lua_State *L, int idx) {
+            auto len = std::size_t{};
+            auto str = lua_tolstring(L, idx, &len);
+            return {str, len};
+        }
+    };
+
+    // the view is only valid while the value stays on the stack or is pinned
+    template<>
+    struct value_ops<types::STRVIEW> {
+        static const char *what() noexcept { return "string or number"; }
+        static bool check(lua_State *L, int idx) noexcept { return lua_isstring(L, idx); }
+        static std::string_view convert(lua_State *L, int idx) noexcept {
+            auto len = std::size_t{};
+            auto str = lua_tolstring(L, idx, &len);
+            return {str, len};
+        }
+    };
+
+    template<>
+    struct value_ops<types::BOOL> {
+        static const char *what() noexcept { return "boolean"; }
+        // because lua_isboolean is macro
+        static bool check(lua_State *L, int idx) noexcept { return lua_isboolean(L, idx); }
+        static bool convert(lua_State *L, int idx) noexcept { return lua_toboolean(L, idx); }
+    };
+
+    // any value has a type
+    template<>
+    struct value_ops<types::LTYPE> {
+        static const char *what() noexcept { return "any"; }
+        static bool check(lua_State *, int) noexcept { return true; }
+        static types convert(lua_State *L, int idx) noexcept {
+            auto typeint = lua_type(L, idx);
+            auto res =
+                typeint == LUA_TNUMBER ? types::NUM :
+                typeint == LUA_TSTRING ? types::STR :
+                typeint == LUA_TBOOLEAN ? types::BOOL :
+                typeint == LUA_TTABLE ? types::TABLE :
+                typeint == LUA_TFUNCTION ? types::FUNC :
+                typeint == LUA_TNIL ? types::NIL :
+                types::OTHER;
+            if (res == types::NUM && lua_isinteger(L, idx))
+                res = types::INT;
+            return res;
+        }
+    };
+
+    // name of the expected type in error messages
+    const char *type_what(types type) noexcept {
+        switch (type) {
+        case types::INT: return value_ops<types::INT>::what();
+        case types::NUM: return value_ops<types::NUM>::what();
+        case types::STR: return value_ops<types::STR>::what();
+        case types::STRVIEW: return value_ops<types::STRVIEW>::what();
+        case types::BOOL: return value_ops<types::BOOL>::what();
+        case types::TABLE: return "table";
+        case types::FUNC: return "function";
+        default: return "supported";
+        }
+    }
+
+    // copies the key or value at idx for table_batch. strings are appended to chars,
+    // table_batch::relink() points them there once the batch is filled
+    void copy_value(lua_State *L, int idx, table_value &out, std::string &chars) {
+        out.string = {};
+        switch (lua_type(L, idx)) {
+        case LUA_TNUMBER:
+            if (lua_isinteger(L, idx)) {
+                out.type = types::INT;
+                out.integer = lua_tointegerx(L, idx, NULL);
+            } else {
+                out.type = types::NUM;
+                out.number = lua_tonumberx(L, idx, NULL);
+            }
+            break;
+        case LUA_TSTRING:
+            out.type = types::STR;
+            out.string = value_ops<types::STRVIEW>::convert(L, idx);
+            chars.append(out.string.data(), out.string.size());
+            break;
+        case LUA_TBOOLEAN:
+            out.type = types::BOOL;
+            out.boolean = lua_toboolean(L, idx);
+            break;
+        case LUA_TTABLE:
+            out.type = types::TABLE;
+            break;
+        case LUA_TFUNCTION:
+            out.type = types::FUNC;
+            break;
+        default:
+            out.type = types::OTHER;
+        }
+    }
+
+    // lua_next() on the table and key at 1 and 2, run by lua_pcall() where the key may no
+    // longer be in the table. returns nothing once the traversal is over
+    int next_pair(lua_State *L) {
+        return lua_next(L, 1) ? 2 : 0;
+    }
+
+    const char *budget_what(budget_error hit) noexcept {
+        switch (hit) {
+        case budget_error::INSTRUCTIONS: return "instruction budget exceeded";
+        case budget_error::WALL_TIME: return "wall time budget exceeded";
+        case budget_error::MEMORY: return "memory budget exceeded";
+        default: return "";
+        }
+    }
+
+#ifdef LUAI_INSTRUMENT
+    // adds one sample to the log2 bucket of its nanoseconds
+    void record(latency_histogram &hist, std::chrono::steady_clock::duration elapsed) noexcept {
+        auto ns = static_cast<std::uint64_t>(std::max<std::int64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), 0));
+        auto bucket = std::size_t{};
+        while (bucket + 1 < latency_histogram::BUCKETS && (ns >> (bucket + 1)) != 0)
+            ++bucket;
+        ++hist.buckets[bucket];
+        ++hist.count;
+        hist.total_ns += ns;
+        hist.max_ns = std::max(hist.max_ns, ns);
+    }
+
+    // counters, histograms and profiler samples of a state, see instrument_snapshot
+    struct instruments {
+        // hot_spots is filled on export from samples
+        instrument_snapshot data {};
+        std::unordered_map<std::string, std::uint64_t> samples;
+        // reused to build sample keys
+        std::string location;
+        int sample_interval {};
+
+        // records the time from creation to destruction into hist
+        struct timer {
+            latency_histogram *hist;
+            std::chrono::steady_clock::time_point start;
+            ~timer() { record(*hist, std::chrono::steady_clock::now() - start); }
+        };
+
+        void count_get() noexcept { ++data.get_calls; }
+        void count_type_error() noexcept { ++data.type_errors; }
+        void count_native() noexcept { ++data.native_calls; }
+        void stack_depth(lua_State *L) noexcept { data.max_stack_depth = std::max(data.max_stack_depth, lua_gettop(L)); }
+        void allocated(std::size_t bytes) noexcept { data.bytes_allocated += bytes; }
+
+        timer time_chunk() noexcept {
+            ++data.chunk_runs;
+            return {&data.run_chunk, std::chrono::steady_clock::now()};
+        }
+
+        timer time_function() noexcept {
+            ++data.function_calls;
+            return {&data.function_call, std::chrono::steady_clock::now()};
+        }
+
+        int profile_interval() const noexcept { return sample_interval; }
+        void set_profile_interval(int interval) noexcept { sample_interval = interval; }
+
+        // called from the count hook
+        void sample(lua_State *L, lua_Debug *ar) noexcept {
+            if (!sample_interval || !lua_getinfo(L, "Sl", ar))
+                return;
+            try {
+                location.assign(ar->short_src);
+                location += ':';
+                location += std::to_string(ar->currentline);
+                ++samples[location];
+            } catch (std::bad_alloc &) {}
+        }
+
+        instrument_snapshot snapshot() const {
+            auto snap = data;
+            snap.enabled = true;
+            snap.hot_spots.reserve(samples.size());
+            for (auto &entry : samples)
+                snap.hot_spots.push_back({entry.first, entry.second});
+            std::sort(snap.hot_spots.begin(), snap.hot_spots.end(), [](auto &lhs, auto &rhs) {
+                return lhs.samples > rhs.samples;
+            });
+            return snap;
+        }
+
+        void reset() noexcept {
+            data = {};
+            samples.clear();
+        }
+    };
+#else
+    // built without LUAI_INSTRUMENT: same interface, nothing recorded
+    struct instruments {
+        struct timer {
+            ~timer() {}
+        };
+
+        void count_get() noexcept {}
+        void count_type_error() noexcept {}
+        void count_native() noexcept {}
+        void stack_depth(lua_State *) noexcept {}
+        void allocated(std::size_t) noexcept {}
+        timer time_chunk() noexcept { return {}; }
+        timer time_function() noexcept { return {}; }
+        int profile_interval() const noexcept { return 0; }
+        void set_profile_interval(int) noexcept {}
+        void sample(lua_State *, lua_Debug *) noexcept {}
+        instrument_snapshot snapshot() const { return {}; }
+        void reset() noexcept {}
+    };
+#endif
+
+    // lua owned storage of a native callable: the destroyer, then the callable itself, placed
+    // by hand past the header since lua only aligns userdata to LUAI_MAXALIGN
+    struct native_header {
+        void (*destroy)(void *);
+        void *object;
+    };
+
+    constexpr auto NATIVE_METATABLE = "luai.native";
+
+    // __gc of native callables
+    int collect_native(lua_State *L) {
+        auto header = static_cast<native_header *>(lua_touserdata(L, 1));
+        if (header->destroy)
+            header->destroy(header->object);
+        return 0;
+    }
+
+    // lua_Reader over a memory region, hands it out in one piece
+    struct region_source {
+        const char *data;
+        std::size_t size;
+    };
+
+    const char *read_region(lua_State *, void *ud, std::size_t *size) {
+        auto src = static_cast<region_source *>(ud);
+        *size = src->size;
+        src->size = 0;
+        return *size ? src->data : nullptr;
+    }
+
+    // lua_Reader over a std::istream, one block at a time
+    struct stream_source {
+        std::istream &in;
+        std::vector<char> block;
+        // set if the stream threw, exceptions must not cross lua_load()
+        bool failed;
+    };
+
+    const char *read_stream(lua_State *, void *ud, std::size_t *size) {
+        auto src = static_cast<stream_source *>(ud);
+        *size = 0;
+        try {
+            if (src->in.read(src->block.data(), src->block.size()) || src->in.gcount() > 0)
+                *size = static_cast<std::size_t>(src->in.gcount());
+        } catch (...) {
+            src->failed = true;
+        }
+        return *size ? src->block.data() : nullptr;
+    }
+
+    // like luaL_loadfile(), ignores a first line starting with #
+    void skip_shebang(region_source &src) noexcept {
+        if (src.size == 0 || src.data[0] != '#')
+            return;
+        // keep the newline so that line numbers are right
+        while (src.size && *src.data != '\n') {
+            ++src.data;
+            --src.size;
+        }
+    }
+
+    // lua_Writer appending to a std::string
+    // out of memory stops lua_dump() instead of throwing through lua
+    int write_to_string(lua_State *, const void *p, std::size_t sz, void *ud) noexcept {
+        try {
+            static_cast<std::string *>(ud)->append(static_cast<const char *>(p), sz);
+        } catch (std::bad_alloc &) {
+            return 1;
+        }
+        return 0;
+    }
 }
 
 struct lua_interpreter::impl {
     lua_State *L;
 
-    impl() {
-        auto state = luaL_newstate();
+    // compiled chunk cache. the compiled functions live in the registry,
+    // entries are ordered from the most to the least recently used
+    struct chunk_entry {
+        std::uint64_t hash;
+        std::string source;
+        int ref;
+    };
+    std::list<chunk_entry> chunk_lru;
+    std::unordered_map<std::uint64_t, std::list<chunk_entry>::iterator> chunk_index;
+    std::size_t chunk_limit {DEFAULT_CHUNK_CACHE_LIMIT};
+    std::string chunk_dir;
+    chunk_cache_stats chunk_stats {};
+
+    // memory policy, nullptr means realloc/free
+    std::shared_ptr<allocator> alloc;
+    alloc_stats alloc_counters {};
+    // bumped by reset(), so registry references of an older state are never touched
+    unsigned generation {};
+
+    // a value kept alive in the registry, shared by the handles that outlive the stack
+    struct registry_ref;
+
+    // strings viewed under view_guards are kept in the anchor table in the registry, as
+    // anchor[str] = number of live guards when str was first viewed. anchored is the number
+    // of strings in it, view_guards the number of live guards
+    int anchor_ref {LUA_NOREF};
+    int anchored {};
+    int view_guards {};
+
+    // { copy of the globals, metatable of the globals, { [table] = copy of table } }
+    // in the registry, see snapshot_globals()
+    int baseline_ref {LUA_NOREF};
+
+    // limits of the running budgeted call, see start_budget()
+    struct budget_state {
+        bool active;
+        // 0 if unlimited
+        std::size_t instructions;
+        std::size_t executed;
+        int interval;
+        bool timed;
+        std::chrono::steady_clock::time_point deadline;
+        // bound of bytes_in_use, 0 if unlimited
+        std::size_t memory_cap;
+        // an allocation was refused. it only counts as hit if the run then ends with
+        // LUA_ERRMEM: lua may collect garbage and retry, or the script may pcall the error
+        bool memory_refused;
+        budget_error hit;
+    };
+    budget_state budget {};
+    // status of the last run_chunk() or call_chunk(), for stop_budget()
+    int last_status {LUA_OK};
+    // count of the installed instruction hook, 0 if none. see update_hook()
+    int hook_count {};
+
+    instruments inst;
+
+    impl(std::shared_ptr<allocator> policy)
+        : alloc{std::move(policy)}
+    {
+        open_state();
+    }
+
+    // same as luaL_newstate(), but allocating through allocate()
+    void open_state() {
+        auto state = lua_newstate(allocate, this);
         if (state == NULL)
             throw luastate_error{"cannot create lua state: out of memory"};
+        lua_atpanic(state, panic);
+        // lets code holding only the lua_State find the impl
+        *static_cast<impl **>(lua_getextraspace(state)) = this;
         L = state;
     }
 
+    // lua_Alloc, ud is the impl
+    static void *allocate(void *ud, void *ptr, std::size_t osize, std::size_t nsize) noexcept {
+        auto self = static_cast<impl *>(ud);
+        auto &counters = self->alloc_counters;
+        auto oldsize = ptr ? osize : 0;
+        auto &budget = self->budget;
+        if (budget.memory_cap && nsize > oldsize
+            && counters.bytes_in_use - oldsize + nsize > budget.memory_cap)
+        {
+            // lua collects garbage and retries before it raises the memory error
+            budget.memory_refused = true;
+            return nullptr;
+        }
+        void *block = nullptr;
+        if (self->alloc)
+            block = self->alloc->realloc(ptr, osize, nsize);
+        else if (nsize == 0)
+            std::free(ptr);
+        else
+            block = std::realloc(ptr, nsize);
+
+        if (nsize == 0) {
+            if (ptr) {
+                ++counters.frees;
+                counters.bytes_in_use -= oldsize;
+            }
+            return nullptr;
+        }
+        if (block) {
+            if (nsize > oldsize)
+                self->inst.allocated(nsize - oldsize);
+            ++counters.allocations;
+            counters.bytes_in_use = counters.bytes_in_use - oldsize + nsize;
+            counters.peak_bytes = std::max(counters.peak_bytes, counters.bytes_in_use);
+        }
+        return block;
+    }
+
+    // same message as the panic function of luaL_newstate()
+    static int panic(lua_State *L) {
+        std::fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+        return 0;
+    }
+
+    void reset() {
+        // the cached functions die with the state
+        chunk_lru.clear();
+        chunk_index.clear();
+        chunk_stats.entries = 0;
+        chunk_stats.bytes = 0;
+        anchor_ref = LUA_NOREF;
+        anchored = 0;
+        baseline_ref = LUA_NOREF;
+        lua_close(L);
+        L = nullptr;
+        ++generation;
+        if (alloc)
+            alloc->reset();
+        open_state();
+        hook_count = 0;
+        update_hook();
+    }
+
     impl(impl &&) = delete;
     impl &operator=(impl &&) = delete;
 
@@ -55,15 +527,272 @@ struct lua_interpreter::impl {
 
     // pop 0, push 0
     std::tuple<bool, std::string> run_chunk(const char *code) noexcept {
-        auto error = luaL_loadstring(L, code) || lua_pcall(L, 0, 0, 0);
-        if (error) {
-            auto errmsg = lua_tostring(L, -1);
-            lua_pop(L, 1); // remove err msg
-            return { false, errmsg };
+        auto timing = inst.time_chunk();
+        last_status = luaL_loadstring(L, code);
+        if (last_status == LUA_OK)
+            last_status = lua_pcall(L, 0, 0, 0);
+        if (last_status != LUA_OK)
+            return pop_error();
+        return { true, {} };
+    }
+
+    // pop 0, push 0
+    std::tuple<bool, std::string> run_reader(lua_Reader reader, void *data, const char *chunkname) noexcept {
+        auto timing = inst.time_chunk();
+        auto error = lua_load(L, reader, data, chunkname, NULL) || lua_pcall(L, 0, 0, 0);
+        if (error)
+            return pop_error();
+        return { true, {} };
+    }
+
+    // pop 0, push 0
+    std::tuple<bool, std::string> run_stream(std::istream &in, const char *chunkname, std::size_t block_size) noexcept {
+        try {
+            auto src = stream_source{in, std::vector<char>(std::max<std::size_t>(block_size, 1)), false};
+            auto ret = run_reader(read_stream, &src, chunkname);
+            if (src.failed)
+                return { false, std::string{"cannot read "} + chunkname };
+            return ret;
+        } catch (std::bad_alloc &) {
+            return { false, "not enough memory" };
+        }
+    }
+
+    // pop 0, push 0
+    std::tuple<bool, std::string> run_file(const char *path) noexcept {
+        auto chunkname = std::string{"@"} + path;
+#ifdef LUAI_HAS_MMAP
+        auto fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return { false, std::string{"cannot open "} + path + ": " + std::strerror(errno) };
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            return { false, std::string{"cannot stat "} + path + ": " + std::strerror(errno) };
+        }
+        auto size = static_cast<std::size_t>(st.st_size);
+        void *mapped = nullptr;
+        if (size > 0) {
+            mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                ::close(fd);
+                return { false, std::string{"cannot map "} + path + ": " + std::strerror(errno) };
+            }
+            ::madvise(mapped, size, MADV_SEQUENTIAL);
         }
+        ::close(fd);
+        auto src = region_source{static_cast<const char *>(mapped), size};
+        skip_shebang(src);
+        auto ret = run_reader(read_region, &src, chunkname.c_str());
+        if (mapped)
+            ::munmap(mapped, size);
+        return ret;
+#else
+        auto in = std::ifstream{path, std::ios::binary};
+        if (!in)
+            return { false, std::string{"cannot open "} + path };
+        return run_stream(in, chunkname.c_str(), 64 * 1024);
+#endif
+    }
+
+    // runs the function on the top of the stack
+    // pop 1, push 0
+    std::tuple<bool, std::string> call_chunk() noexcept {
+        auto timing = inst.time_chunk();
+        last_status = lua_pcall(L, 0, 0, 0);
+        if (last_status != LUA_OK)
+            return pop_error();
         return { true, {} };
     }
 
+    void start_budget(const exec_budget &limits) noexcept {
+        budget = {};
+        budget.active = true;
+        budget.instructions = limits.instructions;
+        budget.interval = std::max(limits.hook_interval, 1);
+        if (budget.instructions)
+            budget.interval = static_cast<int>(std::min<std::size_t>(budget.interval, budget.instructions));
+        if (limits.wall_time.count() > 0) {
+            budget.timed = true;
+            budget.deadline = std::chrono::steady_clock::now() + limits.wall_time;
+        }
+        if (limits.memory)
+            budget.memory_cap = alloc_counters.bytes_in_use + limits.memory;
+        update_hook();
+    }
+
+    // turns the hook off, the result is failed if a limit was hit
+    std::tuple<bool, std::string, budget_error> stop_budget(std::tuple<bool, std::string> ret) noexcept {
+        auto hit = budget.hit;
+        if (hit == budget_error::NONE && budget.memory_refused && last_status == LUA_ERRMEM)
+            hit = budget_error::MEMORY;
+        budget = {};
+        update_hook();
+        if (hit != budget_error::NONE)
+            return { false, budget_what(hit), hit };
+        return { std::get<0>(ret), std::move(std::get<1>(ret)), hit };
+    }
+
+    // one count hook serves the budget and the profiler, at the smaller of their intervals
+    void update_hook() noexcept {
+        auto count = 0;
+        if (budget.instructions || budget.timed)
+            count = budget.interval;
+        auto sampling = inst.profile_interval();
+        if (sampling && (!count || sampling < count))
+            count = sampling;
+        hook_count = count;
+        if (count)
+            lua_sethook(L, instruction_hook, LUA_MASKCOUNT, count);
+        else
+            lua_sethook(L, NULL, 0, 0);
+    }
+
+    static void instruction_hook(lua_State *L, lua_Debug *ar) {
+        auto &self = of(L);
+        self.inst.sample(L, ar);
+        auto &budget = self.budget;
+        if (!budget.active) {
+            // left on a coroutine created while the hook was needed
+            if (!self.hook_count)
+                lua_sethook(L, NULL, 0, 0);
+            return;
+        }
+        if (budget.hit == budget_error::NONE) {
+            budget.executed += static_cast<std::size_t>(self.hook_count);
+            if (budget.instructions && budget.executed >= budget.instructions)
+                budget.hit = budget_error::INSTRUCTIONS;
+            else if (budget.timed && std::chrono::steady_clock::now() >= budget.deadline)
+                budget.hit = budget_error::WALL_TIME;
+            else
+                return;
+        }
+        // raise on every instruction from now on, so pcall in the script cannot go on
+        self.hook_count = 1;
+        lua_sethook(L, instruction_hook, LUA_MASKCOUNT, 1);
+        luaL_error(L, "%s", budget_what(budget.hit));
+    }
+
+    // pop 1, push 0
+    std::tuple<bool, std::string> pop_error() noexcept {
+        auto msg = lua_tostring(L, -1);
+        auto errmsg = std::string{msg ? msg : "(error object is not a string)"};
+        lua_pop(L, 1); // remove err msg
+        return { false, std::move(errmsg) };
+    }
+
+    // pushes the compiled chunk, compiles it only if it is not cached. out of memory,
+    // the on-disk copy is skipped and the chunk is left uncached, it still runs
+    // pop 0, push 1 (function or err msg)
+    int push_cached_chunk(const char *code) noexcept {
+        auto len = std::strlen(code);
+        auto hash = hash_source(code, len);
+        auto found = chunk_index.find(hash);
+        if (found != chunk_index.end()) {
+            auto &entry = *found->second;
+            if (entry.source.size() == len && std::memcmp(entry.source.data(), code, len) == 0) {
+                ++chunk_stats.hits;
+                chunk_lru.splice(chunk_lru.begin(), chunk_lru, found->second);
+                lua_rawgeti(L, LUA_REGISTRYINDEX, entry.ref);
+                return LUA_OK;
+            }
+            // hash collision, the new chunk takes over the slot
+            evict_chunk(found->second);
+        }
+        ++chunk_stats.misses;
+
+        auto loaded = false;
+        try {
+            loaded = load_dumped_chunk(code, len, hash);
+        } catch (std::bad_alloc &) {}
+        if (!loaded) {
+            auto error = luaL_loadbuffer(L, code, len, code);
+            if (error)
+                return error;
+            try {
+                dump_chunk(code, len, hash);
+            } catch (std::bad_alloc &) {}
+        }
+        if (len > chunk_limit)
+            return LUA_OK;
+
+        auto entry = chunk_lru.end();
+        try {
+            chunk_lru.push_front({hash, std::string{code, len}, LUA_NOREF});
+            entry = chunk_lru.begin();
+            chunk_index[hash] = entry;
+        } catch (std::bad_alloc &) {
+            if (entry != chunk_lru.end())
+                chunk_lru.erase(entry);
+            return LUA_OK;
+        }
+        lua_pushvalue(L, -1);
+        entry->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        chunk_stats.bytes += len;
+        ++chunk_stats.entries;
+        trim_chunk_cache();
+        return LUA_OK;
+    }
+
+    // pop 0, push 0
+    void evict_chunk(std::list<chunk_entry>::iterator it) noexcept {
+        luaL_unref(L, LUA_REGISTRYINDEX, it->ref);
+        chunk_stats.bytes -= it->source.size();
+        --chunk_stats.entries;
+        ++chunk_stats.evictions;
+        chunk_index.erase(it->hash);
+        chunk_lru.erase(it);
+    }
+
+    void trim_chunk_cache() noexcept {
+        while (chunk_stats.bytes > chunk_limit)
+            evict_chunk(std::prev(chunk_lru.end()));
+    }
+
+    std::string dumped_chunk_path(std::size_t len, std::uint64_t hash) const {
+        char name[48];
+        std::snprintf(name, sizeof name, "/%016llx-%zu.luac", static_cast<unsigned long long>(hash), len);
+        return chunk_dir + name;
+    }
+
+    // tries the bytecode persisted in chunk_dir. the file starts with the source it was
+    // compiled from, a file of another source with the same hash and length is ignored
+    // pop 0, push 1 if successful
+    bool load_dumped_chunk(const char *code, std::size_t len, std::uint64_t hash) {
+        if (chunk_dir.empty())
+            return false;
+        auto file = std::ifstream{dumped_chunk_path(len, hash), std::ios::binary};
+        if (!file)
+            return false;
+        auto contents = std::string{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+        if (contents.size() <= len || std::memcmp(contents.data(), code, len) != 0)
+            return false;
+        if (luaL_loadbufferx(L, contents.data() + len, contents.size() - len, code, "b") != LUA_OK) {
+            lua_pop(L, 1); // remove err msg, fall back to compiling
+            return false;
+        }
+        return true;
+    }
+
+    // persists the function on the top of the stack to chunk_dir, after its source code
+    // pop 0, push 0
+    void dump_chunk(const char *code, std::size_t len, std::uint64_t hash) {
+        if (chunk_dir.empty())
+            return;
+        auto contents = std::string{code, len};
+        if (lua_dump(L, write_to_string, &contents, 0) != 0)
+            return;
+        // write then rename so that other processes never load a partial file
+        auto path = dumped_chunk_path(len, hash);
+        auto tmppath = path + ".tmp";
+        {
+            auto file = std::ofstream{tmppath, std::ios::binary | std::ios::trunc};
+            if (!file.write(contents.data(), contents.size()))
+                return;
+        }
+        std::rename(tmppath.c_str(), path.c_str());
+    }
+
     // pop 0, push 1
     template<var_where VarWhere>
     void get_by_key(keytype_t<VarWhere> key, int tidx);
@@ -73,87 +802,329 @@ struct lua_interpreter::impl {
     // pop 0, push 0
     template<var_where VarWhere, class R, class Cvrt, class Check, class KeyT = keytype_t<VarWhere>>
     R get_what_impl(KeyT key, int tidx, Cvrt &&cvrtfunc, Check &&checkfunc, const char *throwmsg) {
+        inst.count_get();
         get_by_key<VarWhere>(key, tidx);
+        inst.stack_depth(L);
         if (!checkfunc(L, -1)) {
             lua_pop(L, 1);
+            inst.count_type_error();
             throw luastate_error{std::string{"variable/field ["} + key + "] is not " + throwmsg};
         }
-        auto result = cvrtfunc(L, -1, NULL);
+        auto result = cvrtfunc(L, -1);
         lua_pop(L, 1);
         return {result};
     }
 
-    // PARTIAL SPECIALIZATIONS
+    // PARTIAL SPECIALIZATIONS for basic types
     // calls get_what_impl(), pop 0, push 0
     template<var_where VarWhere, types Type, class R = get_var_t<Type>, class KeyT = keytype_t<VarWhere>>
-    std::enable_if_t<Type == types::INT, R> get_what(KeyT key, int tidx) {
-        return get_what_impl<VarWhere, R>(key, tidx, lua_tointegerx, lua_isinteger,
-            "integer");
+    std::enable_if_t<Type != types::TABLE && Type != types::STRVIEW, R> get_what(KeyT key, int tidx) {
+        return get_what_impl<VarWhere, R>(key, tidx, value_ops<Type>::convert, value_ops<Type>::check,
+            value_ops<Type>::what());
     }
 
     // PARTIAL SPECIALIZATIONS
-    // calls get_what_impl(), pop 0, push 0
+    // calls get_what_impl(), pins the string, pop 0, push 0
     template<var_where VarWhere, types Type, class R = get_var_t<Type>, class KeyT = keytype_t<VarWhere>>
-    std::enable_if_t<Type == types::NUM, R> get_what(KeyT key, int tidx) {
-        return get_what_impl<VarWhere, R>(key, tidx, lua_tonumberx, lua_isnumber,
-            "number or string convertible to number");
+    std::enable_if_t<Type == types::STRVIEW, R> get_what(KeyT key, int tidx) {
+        require_view_guard();
+        auto convert_pinned = [this](lua_State *, int idx) { return pin_view(idx); };
+        return get_what_impl<VarWhere, R>(key, tidx, convert_pinned, value_ops<Type>::check,
+            value_ops<Type>::what());
     }
 
-    // PARTIAL SPECIALIZATIONS
-    // calls get_what_impl(), pop 0, push 0
-    template<var_where VarWhere, types Type, class R = get_var_t<Type>, class KeyT = keytype_t<VarWhere>>
-    std::enable_if_t<Type == types::STR, R> get_what(KeyT key, int tidx) {
-        return get_what_impl<VarWhere, R>(key, tidx, lua_tolstring, lua_isstring,
-            "string or number");
+    // like get_what(), but a missing or mistyped value is reported in the result
+    // pop 0, push 0
+    template<var_where VarWhere, types Type, class KeyT = keytype_t<VarWhere>>
+    lookup_result<Type> try_get_what(KeyT key, int tidx) {
+        if constexpr (Type == types::STRVIEW)
+            require_view_guard();
+        inst.count_get();
+        get_by_key<VarWhere>(key, tidx);
+        inst.stack_depth(L);
+        auto result = lookup_result<Type>{Type, key};
+        if (value_ops<Type>::check(L, -1)) {
+            if constexpr (Type == types::STRVIEW)
+                result.val = pin_view(-1);
+            else
+                result.val = value_ops<Type>::convert(L, -1);
+        } else {
+            result.got = value_ops<types::LTYPE>::convert(L, -1);
+            result.err = result.got == types::NIL ? lookup_error::MISSING : lookup_error::WRONG_TYPE;
+        }
+        lua_pop(L, 1);
+        return result;
     }
 
-    // PARTIAL SPECIALIZATIONS
-    // calls get_what_impl(), pop 0, push 0
-    template<var_where VarWhere, types Type, class R = get_var_t<Type>, class KeyT = keytype_t<VarWhere>>
-    std::enable_if_t<Type == types::BOOL, R> get_what(KeyT key, int tidx) {
-        static auto toboolean = [](auto ls, auto idx, auto) { return static_cast<R>(lua_toboolean(ls, idx)); };
-        // because lua_isboolean is macro
-        static auto isboolean = [](auto ls, auto idx) { return lua_isboolean(ls, idx); };
-        return get_what_impl<VarWhere, R>(key, tidx, toboolean, isboolean,
-            "boolean");
+    void require_view_guard() const {
+        if (view_guards == 0)
+            throw luastate_error{"types::STRVIEW needs a live view_guard"};
     }
 
-    // like get_what_impl(), but returns a type enum
+    // converts the string at idx and anchors it until the innermost view_guard is gone
     // pop 0, push 0
-    template<var_where VarWhere, class KeyT = keytype_t<VarWhere>>
-    auto get_type_impl(KeyT key, int tidx) {
-        get_by_key<VarWhere>(key, tidx);
-        auto typeint = lua_type(L, -1);
-        auto res = 
-            typeint == LUA_TNUMBER ? types::NUM :
-            typeint == LUA_TSTRING ? types::STR :
-            typeint == LUA_TBOOLEAN ? types::BOOL :
-            typeint == LUA_TTABLE ? types::TABLE :
-            typeint == LUA_TNIL ? types::NIL :
-            types::OTHER;
-        if (res == types::NUM && lua_isinteger(L, -1))
-            res = types::INT;
+    std::string_view pin_view(int idx) {
+        // converts numbers in place, so the string itself is anchored
+        auto view = value_ops<types::STRVIEW>::convert(L, idx);
+        idx = lua_absindex(L, idx);
+        if (anchor_ref == LUA_NOREF) {
+            lua_newtable(L);
+            anchor_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+        lua_rawgeti(L, LUA_REGISTRYINDEX, anchor_ref);
+        lua_pushvalue(L, idx);
+        // already held by this guard or an outer one, which lives at least as long
+        if (lua_rawget(L, -2) == LUA_TNIL) {
+            lua_pushvalue(L, idx);
+            lua_pushinteger(L, view_guards);
+            lua_rawset(L, -4);
+            ++anchored;
+        }
+        lua_pop(L, 2);
+        return view;
+    }
+
+    // drops the anchors of the innermost guard, if it added any since there were mark
+    // pop 0, push 0
+    void release_views(int mark) noexcept {
+        if (anchored <= mark)
+            return;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, anchor_ref);
+        // clearing existing fields during traversal is allowed
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+            auto inner = lua_tointeger(L, -1) == view_guards;
+            lua_pop(L, 1);
+            if (inner) {
+                lua_pushvalue(L, -1);
+                lua_pushnil(L);
+                lua_rawset(L, -4);
+                --anchored;
+            }
+        }
         lua_pop(L, 1);
-        return res;
     }
 
-    // PARTIAL SPECIALIZATIONS
-    // calls get_type_impl(), pop 0, push 0
-    template<var_where VarWhere, types Type, class R = get_var_t<Type>, class KeyT = keytype_t<VarWhere>>
-    std::enable_if_t<Type == types::LTYPE, R> get_what(KeyT key, int tidx) {
-        return get_type_impl<VarWhere>(key, tidx);
+    // tables reachable from the globals in this many steps are restored by restore_globals(),
+    // the library tables and package.loaded among them
+    static constexpr int BASELINE_DEPTH = 2;
+
+    // pop 0, push 0
+    void snapshot_globals() {
+        if (baseline_ref != LUA_NOREF)
+            luaL_unref(L, LUA_REGISTRYINDEX, baseline_ref);
+        lua_createtable(L, 3, 0);
+        auto baseline = lua_gettop(L);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+        auto globals = lua_gettop(L);
+        push_copy(globals);
+        lua_rawseti(L, baseline, 1);
+        if (lua_getmetatable(L, globals))
+            lua_rawseti(L, baseline, 2);
+        lua_newtable(L);
+        auto copies = lua_gettop(L);
+        remember_fields(copies, globals, BASELINE_DEPTH);
+        lua_rawseti(L, baseline, 3);
+        lua_pop(L, 1);
+        baseline_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    // pop 0, push 0
+    void restore_globals() {
+        if (baseline_ref == LUA_NOREF)
+            throw luastate_error{"no snapshot of the globals, see snapshot_globals()"};
+        lua_rawgeti(L, LUA_REGISTRYINDEX, baseline_ref);
+        auto baseline = lua_gettop(L);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+        auto globals = lua_gettop(L);
+        lua_rawgeti(L, baseline, 1);
+        restore_table(globals, lua_gettop(L));
+        lua_pop(L, 1);
+        // nil removes a metatable set since
+        lua_rawgeti(L, baseline, 2);
+        lua_setmetatable(L, globals);
+        lua_rawgeti(L, baseline, 3);
+        auto copies = lua_gettop(L);
+        lua_pushnil(L);
+        while (lua_next(L, copies)) {
+            restore_table(lua_gettop(L) - 1, lua_gettop(L));
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 3);
+    }
+
+    // pushes a new table with the pairs of the table at tidx, with raw access
+    // pop 0, push 1
+    void push_copy(int tidx) {
+        lua_newtable(L);
+        lua_pushnil(L);
+        while (lua_next(L, tidx)) {
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, -4);
+        }
+    }
+
+    // copies[t] = copy of t for every table t reachable from the table at tidx in up to depth
+    // steps. walks breadth first, so a table met at several depths is copied and followed
+    // from the shallowest one. the globals themselves are skipped
+    // pop 0, push 0
+    void remember_fields(int copies, int tidx, int depth) {
+        luaL_checkstack(L, 12, "snapshot of the globals");
+        lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+        auto globals = lua_gettop(L);
+        // the tables whose fields are copied in this step
+        lua_createtable(L, 1, 0);
+        lua_pushvalue(L, tidx);
+        lua_rawseti(L, -2, 1);
+        for (; depth > 0; --depth) {
+            auto level = lua_gettop(L);
+            lua_newtable(L);
+            auto next = lua_gettop(L);
+            auto queued = lua_Integer{};
+            auto n = static_cast<lua_Integer>(lua_rawlen(L, level));
+            for (auto i = lua_Integer{1}; i <= n; ++i) {
+                lua_rawgeti(L, level, i);
+                auto t = lua_gettop(L);
+                lua_pushnil(L);
+                while (lua_next(L, t)) {
+                    auto value = lua_gettop(L);
+                    if (lua_istable(L, value) && !lua_rawequal(L, value, globals)) {
+                        lua_pushvalue(L, value);
+                        if (lua_rawget(L, copies) == LUA_TNIL) {
+                            lua_pushvalue(L, value);
+                            push_copy(value);
+                            lua_rawset(L, copies);
+                            lua_pushvalue(L, value);
+                            lua_rawseti(L, next, ++queued);
+                        }
+                        lua_pop(L, 1);
+                    }
+                    lua_pop(L, 1);
+                }
+                lua_pop(L, 1);
+            }
+            lua_remove(L, level);
+        }
+        lua_pop(L, 2);
+    }
+
+    // makes the table at tidx hold exactly the pairs of the copy at cidx, with raw access
+    // pop 0, push 0
+    void restore_table(int tidx, int cidx) {
+        // clearing existing fields during traversal is allowed
+        lua_pushnil(L);
+        while (lua_next(L, tidx)) {
+            lua_pop(L, 1);
+            lua_pushvalue(L, -1);
+            if (lua_rawget(L, cidx) == LUA_TNIL) {
+                lua_pushvalue(L, -2);
+                lua_pushnil(L);
+                lua_rawset(L, tidx);
+            }
+            lua_pop(L, 1);
+        }
+        lua_pushnil(L);
+        while (lua_next(L, cidx)) {
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, tidx);
+        }
+    }
+
+    // the impl of a state opened by open_state()
+    static impl &of(lua_State *L) noexcept {
+        return **static_cast<impl **>(lua_getextraspace(L));
+    }
+
+    // like get_what(), but reports failure instead of throwing. the caller checks tidx
+    // pop 0, push 0
+    template<types Type, class R = get_var_t<Type>>
+    bool get_field_unchecked(keytype_t<var_where::TABLE> key, int tidx, R &out) {
+        if constexpr (Type == types::STRVIEW)
+            require_view_guard();
+        lua_getfield(L, tidx, key);
+        auto found = value_ops<Type>::check(L, -1);
+        if (found) {
+            if constexpr (Type == types::STRVIEW)
+                out = pin_view(-1);
+            else
+                out = value_ops<Type>::convert(L, -1);
+        }
+        lua_pop(L, 1);
+        return found;
+    }
+
+    // reads t[1..n] of the table at tidx with raw access, writes them through out
+    // pop 0, push 0
+    template<types Type, class Out>
+    void get_array(int tidx, LuaInt n, Out out) {
+        protect_indexing(tidx);
+        for (auto i = LuaInt{1}; i <= n; ++i) {
+            lua_rawgeti(L, tidx, i);
+            if (!value_ops<Type>::check(L, -1)) {
+                lua_pop(L, 1);
+                inst.count_type_error();
+                throw luastate_error{std::string{"variable/field ["} + i + "] is not " + value_ops<Type>::what()};
+            }
+            *out++ = value_ops<Type>::convert(L, -1);
+            lua_pop(L, 1);
+        }
+    }
+
+    // assumes table is already in the stack at index tidx
+    // pop 0, push 0
+    LuaInt table_rawlen(int tidx) {
+        protect_indexing(tidx);
+        return static_cast<LuaInt>(lua_rawlen(L, tidx));
+    }
+
+    // to_vector() of table_handle and table_frame
+    // pop 0, push 0
+    template<types Type>
+    std::vector<get_var_t<Type>> array_to_vector(int tidx) {
+        auto n = table_rawlen(tidx);
+        auto result = std::vector<get_var_t<Type>>{};
+        result.reserve(static_cast<std::size_t>(n));
+        get_array<Type>(tidx, n, std::back_inserter(result));
+        return result;
+    }
+
+    // copy_into() of table_handle and table_frame
+    // pop 0, push 0
+    template<types Type>
+    std::size_t array_copy_into(int tidx, get_var_t<Type> *buf, std::size_t bufsize) {
+        auto n = std::min(static_cast<std::size_t>(table_rawlen(tidx)), bufsize);
+        get_array<Type>(tidx, static_cast<LuaInt>(n), buf);
+        return n;
     }
 
     // pop 0, push 1
     template<var_where VarWhere, class KeyT = keytype_t<VarWhere>>
     void push_table(KeyT key, int tidx) {
+        inst.count_get();
         get_by_key<VarWhere>(key, tidx);
+        inst.stack_depth(L);
         if (!lua_istable(L, -1)) {
             lua_pop(L, 1);
+            inst.count_type_error();
             throw luastate_error{std::string{"variable/field ["} + key + "] is not table"};
         }
     }
 
+    // pop 0, push 1
+    template<var_where VarWhere, class KeyT = keytype_t<VarWhere>>
+    void push_function(KeyT key, int tidx) {
+        inst.count_get();
+        get_by_key<VarWhere>(key, tidx);
+        inst.stack_depth(L);
+        if (!lua_isfunction(L, -1)) {
+            lua_pop(L, 1);
+            inst.count_type_error();
+            throw luastate_error{std::string{"variable/field ["} + key + "] is not function"};
+        }
+    }
+
     // pop 0, push 0
     int get_top_idx() noexcept {
         return lua_gettop(L);
@@ -167,8 +1138,8 @@ struct lua_interpreter::impl {
     // assumes table is already in the stack at index tidx
     // pop 0, push 0
     auto table_len(int tidx) {
-        return get_what_impl<var_where::FUNC1, LuaInt>(lua_len, tidx, lua_tointegerx, lua_isinteger,
-            "integer");
+        return get_what_impl<var_where::FUNC1, LuaInt>(lua_len, tidx, value_ops<types::INT>::convert,
+            value_ops<types::INT>::check, value_ops<types::INT>::what());
     }
 
     void protect_indexing(int idx) {
@@ -213,7 +1184,11 @@ void lua_interpreter::impl::get_by_key<var_where::FUNC1>(keytype_t<var_where::FU
 const int lua_interpreter::lua_version {LUA_VERSION_NUM};
 
 lua_interpreter::lua_interpreter()
-    : pimpl{std::make_shared<lua_interpreter::impl>()}
+    : lua_interpreter{nullptr}
+{}
+
+lua_interpreter::lua_interpreter(std::shared_ptr<allocator> alloc)
+    : pimpl{std::make_shared<lua_interpreter::impl>(std::move(alloc))}
 {}
 
 lua_interpreter::lua_interpreter(lua_interpreter &&) noexcept = default;
@@ -223,10 +1198,74 @@ void lua_interpreter::openlibs() noexcept {
     return pimpl->openlibs();
 }
 
+void lua_interpreter::reset() {
+    pimpl->reset();
+}
+
+void lua_interpreter::snapshot_globals() {
+    pimpl->snapshot_globals();
+}
+
+void lua_interpreter::restore_globals() {
+    pimpl->restore_globals();
+}
+
+instrument_snapshot lua_interpreter::get_instruments() const {
+    return pimpl->inst.snapshot();
+}
+
+void lua_interpreter::reset_instruments() noexcept {
+    pimpl->inst.reset();
+}
+
+void lua_interpreter::start_profiler(int interval) noexcept {
+    pimpl->inst.set_profile_interval(std::max(interval, 1));
+    pimpl->update_hook();
+}
+
+void lua_interpreter::stop_profiler() noexcept {
+    pimpl->inst.set_profile_interval(0);
+    pimpl->update_hook();
+}
+
+std::uint64_t latency_histogram::quantile_ns(double q) const noexcept {
+    if (count == 0)
+        return 0;
+    auto rank = static_cast<std::uint64_t>(std::min(std::max(q, 0.0), 1.0) * (count - 1)) + 1;
+    auto seen = std::uint64_t{};
+    for (auto i = std::size_t{}; i < BUCKETS; ++i) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return std::min(std::uint64_t{2} << i, max_ns);
+    }
+    return max_ns;
+}
+
+alloc_stats lua_interpreter::get_alloc_stats() const noexcept {
+    return pimpl->alloc_counters;
+}
+
 std::tuple<bool, std::string> lua_interpreter::run_chunk(const char *code) noexcept {
     return pimpl->run_chunk(code);
 }
 
+std::tuple<bool, std::string, budget_error> lua_interpreter::run_chunk(const char *code,
+    const exec_budget &budget) noexcept
+{
+    pimpl->start_budget(budget);
+    return pimpl->stop_budget(pimpl->run_chunk(code));
+}
+
+std::tuple<bool, std::string> lua_interpreter::run_file(const char *path) noexcept {
+    return pimpl->run_file(path);
+}
+
+std::tuple<bool, std::string> lua_interpreter::run_stream(std::istream &in, const char *chunkname,
+    std::size_t block_size) noexcept
+{
+    return pimpl->run_stream(in, chunkname, block_size);
+}
+
 template<types Type>
 get_var_t<Type> lua_interpreter::get_global(keytype_t<var_where::GLOBAL> varname) {
     return pimpl->get_what<var_where::GLOBAL, Type>(varname, IGNORED);
@@ -235,29 +1274,432 @@ get_var_t<Type> lua_interpreter::get_global(keytype_t<var_where::GLOBAL> varname
 template get_var_t<types::INT> lua_interpreter::get_global<types::INT>(keytype_t<var_where::GLOBAL>);
 template get_var_t<types::NUM> lua_interpreter::get_global<types::NUM>(keytype_t<var_where::GLOBAL>);
 template get_var_t<types::STR> lua_interpreter::get_global<types::STR>(keytype_t<var_where::GLOBAL>);
+template get_var_t<types::STRVIEW> lua_interpreter::get_global<types::STRVIEW>(keytype_t<var_where::GLOBAL>);
 template get_var_t<types::BOOL> lua_interpreter::get_global<types::BOOL>(keytype_t<var_where::GLOBAL>);
 template get_var_t<types::LTYPE> lua_interpreter::get_global<types::LTYPE>(keytype_t<var_where::GLOBAL>);
 
+template<types Type>
+lookup_result<Type> lua_interpreter::try_get_global(keytype_t<var_where::GLOBAL> varname) {
+    return pimpl->try_get_what<var_where::GLOBAL, Type>(varname, IGNORED);
+}
+// EXPLICIT INSTANTIATION for basic types
+template lookup_result<types::INT> lua_interpreter::try_get_global<types::INT>(keytype_t<var_where::GLOBAL>);
+template lookup_result<types::NUM> lua_interpreter::try_get_global<types::NUM>(keytype_t<var_where::GLOBAL>);
+template lookup_result<types::STR> lua_interpreter::try_get_global<types::STR>(keytype_t<var_where::GLOBAL>);
+template lookup_result<types::STRVIEW> lua_interpreter::try_get_global<types::STRVIEW>(keytype_t<var_where::GLOBAL>);
+template lookup_result<types::BOOL> lua_interpreter::try_get_global<types::BOOL>(keytype_t<var_where::GLOBAL>);
+
+std::string lookup_status::message() const {
+    auto key = name ? std::string{name} : std::to_string(index);
+    return "variable/field [" + key + "] is not " + type_what(wanted);
+}
+
+void lookup_status::throw_error() const {
+    throw luastate_error{message()};
+}
+
 template<>
 table_handle lua_interpreter::get_global<types::TABLE>(keytype_t<var_where::GLOBAL> varname) {
     pimpl->push_table<var_where::GLOBAL>(varname, IGNORED);
     return {pimpl, nullptr};
 }
 
-struct table_handle::impl {
-    std::shared_ptr<lua_interpreter::impl> pstate;
-    // own a reference to the parent impl to avoid popping stack even if parent itself is freed
-    std::shared_ptr<impl> parent;
-    // where is the current table on the stack
-    int stack_index;
+void lua_interpreter::set_chunk_cache_limit(std::size_t bytes) noexcept {
+    pimpl->chunk_limit = bytes;
+    pimpl->trim_chunk_cache();
+}
 
-    // creation assumes table is already on the top of the stack
-    // currently the creation of table handle is managed by get_global, get_field, get_index functions,
-    // which takes care of pushing
-    // the destruction of table handle is managed by the destructor of this class
-    // beware
-    impl(std::shared_ptr<lua_interpreter::impl> &&interp_impl, std::shared_ptr<impl> &&parent_impl)
-        : pstate{std::move(interp_impl)}, parent{std::move(parent_impl)}
+void lua_interpreter::set_chunk_cache_dir(const char *dir) {
+    pimpl->chunk_dir = dir ? dir : "";
+}
+
+chunk_cache_stats lua_interpreter::get_chunk_cache_stats() const noexcept {
+    return pimpl->chunk_stats;
+}
+
+std::tuple<bool, std::string> lua_interpreter::run_cached(const char *code) noexcept {
+    if (pimpl->push_cached_chunk(code) != LUA_OK)
+        return pimpl->pop_error();
+    return pimpl->call_chunk();
+}
+
+void *lua_interpreter::push_native_storage(std::size_t size, std::size_t align, void (*destroy)(void *)) {
+    auto space = size + align - 1;
+    auto header = static_cast<native_header *>(lua_newuserdata(pimpl->L, sizeof(native_header) + space));
+    void *object = header + 1;
+    header->destroy = destroy;
+    header->object = std::align(align, size, object, space);
+    return header->object;
+}
+
+void lua_interpreter::pop_native_storage() noexcept {
+    lua_pop(pimpl->L, 1);
+}
+
+// the storage is on the top of the stack and holds a constructed callable
+void lua_interpreter::set_native_function(const char *varname, int (*cfunc)(lua_State *)) {
+    auto L = pimpl->L;
+    // only now the destroyer may run
+    if (luaL_newmetatable(L, NATIVE_METATABLE)) {
+        lua_pushcfunction(L, collect_native);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    lua_pushcclosure(L, cfunc, 1);
+    lua_setglobal(L, varname);
+}
+
+void lua_interpreter::register_function(const char *varname, int (*f)(lua_State *)) {
+    lua_register(pimpl->L, varname, f);
+}
+
+void *native::target(lua_State *L) noexcept {
+    lua_interpreter::impl::of(L).inst.count_native();
+    return static_cast<native_header *>(lua_touserdata(L, lua_upvalueindex(1)))->object;
+}
+
+template<types Type>
+get_var_t<Type> native::arg(lua_State *L, int idx) {
+    if (!value_ops<Type>::check(L, idx)) {
+        lua_interpreter::impl::of(L).inst.count_type_error();
+        throw luastate_error{std::string{"bad argument #"} + std::to_string(idx) + " ("
+            + value_ops<Type>::what() + " expected, got " + luaL_typename(L, idx) + ")"};
+    }
+    return value_ops<Type>::convert(L, idx);
+}
+
+void native::throw_arg_range(int idx) {
+    throw luastate_error{std::string{"bad argument #"} + std::to_string(idx) + " (number out of range)"};
+}
+
+void native::throw_push_range() {
+    throw luastate_error{"integer does not fit a lua integer"};
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template get_var_t<types::INT> native::arg<types::INT>(lua_State *, int);
+template get_var_t<types::NUM> native::arg<types::NUM>(lua_State *, int);
+template get_var_t<types::STR> native::arg<types::STR>(lua_State *, int);
+template get_var_t<types::STRVIEW> native::arg<types::STRVIEW>(lua_State *, int);
+template get_var_t<types::BOOL> native::arg<types::BOOL>(lua_State *, int);
+
+template<>
+void native::push<types::INT>(lua_State *L, const get_var_t<types::INT> &value) {
+    lua_pushinteger(L, value);
+}
+
+template<>
+void native::push<types::NUM>(lua_State *L, const get_var_t<types::NUM> &value) {
+    lua_pushnumber(L, value);
+}
+
+template<>
+void native::push<types::STR>(lua_State *L, const get_var_t<types::STR> &value) {
+    lua_pushlstring(L, value.data(), value.size());
+}
+
+template<>
+void native::push<types::STRVIEW>(lua_State *L, const get_var_t<types::STRVIEW> &value) {
+    lua_pushlstring(L, value.data(), value.size());
+}
+
+template<>
+void native::push<types::BOOL>(lua_State *L, const get_var_t<types::BOOL> &value) {
+    lua_pushboolean(L, value);
+}
+
+void native::raise(lua_State *L, const char *msg) {
+    luaL_where(L, 1);
+    lua_pushstring(L, msg);
+    lua_concat(L, 2);
+    lua_error(L);
+    std::abort(); // lua_error() does not return
+}
+
+view_guard::view_guard(lua_interpreter &state)
+    : pstate{state.pimpl}, mark{pstate->anchored}
+{
+    ++pstate->view_guards;
+}
+
+view_guard::~view_guard() {
+    pstate->release_views(mark);
+    --pstate->view_guards;
+}
+
+struct lua_interpreter::impl::registry_ref {
+    std::shared_ptr<impl> pstate;
+    int ref;
+    // state generation the reference belongs to
+    unsigned generation;
+
+    // creation assumes the value is on the top of the stack, pops it
+    registry_ref(std::shared_ptr<impl> interp_impl)
+        : pstate{std::move(interp_impl)}
+        , ref{luaL_ref(pstate->L, LUA_REGISTRYINDEX)}
+        , generation{pstate->generation}
+    {}
+
+    registry_ref(registry_ref &&) = delete;
+    registry_ref &operator=(registry_ref &&) = delete;
+
+    bool valid() const noexcept {
+        return generation == pstate->generation;
+    }
+
+    // pop 0, push 1
+    void push() const noexcept {
+        lua_rawgeti(pstate->L, LUA_REGISTRYINDEX, ref);
+    }
+
+    ~registry_ref() {
+        if (valid())
+            luaL_unref(pstate->L, LUA_REGISTRYINDEX, ref);
+    }
+};
+
+// compiled function
+struct chunk_handle::impl : lua_interpreter::impl::registry_ref {
+    using registry_ref::registry_ref;
+};
+
+chunk_handle::chunk_handle(std::shared_ptr<impl> chunk_impl)
+    : pimpl{std::move(chunk_impl)}
+{}
+
+chunk_handle::chunk_handle(const chunk_handle &) noexcept = default;
+chunk_handle &chunk_handle::operator=(const chunk_handle &) noexcept = default;
+chunk_handle::chunk_handle(chunk_handle &&) noexcept = default;
+chunk_handle &chunk_handle::operator=(chunk_handle &&) noexcept = default;
+chunk_handle::~chunk_handle() = default;
+
+chunk_handle lua_interpreter::load_chunk(const char *code) {
+    if (pimpl->push_cached_chunk(code) != LUA_OK)
+        throw luastate_error{std::get<1>(pimpl->pop_error())};
+    return {std::make_shared<chunk_handle::impl>(pimpl)};
+}
+
+std::tuple<bool, std::string> lua_interpreter::run_chunk(const chunk_handle &chunk) noexcept {
+    if (!chunk.pimpl || chunk.pimpl->pstate != pimpl || !chunk.pimpl->valid())
+        return { false, "chunk does not belong to this lua state" };
+    chunk.pimpl->push();
+    return pimpl->call_chunk();
+}
+
+std::tuple<bool, std::string, budget_error> lua_interpreter::run_chunk(const chunk_handle &chunk,
+    const exec_budget &budget) noexcept
+{
+    if (!chunk.pimpl || chunk.pimpl->pstate != pimpl || !chunk.pimpl->valid())
+        return { false, "chunk does not belong to this lua state", budget_error::NONE };
+    chunk.pimpl->push();
+    pimpl->start_budget(budget);
+    return pimpl->stop_budget(pimpl->call_chunk());
+}
+
+struct function_handle::impl : lua_interpreter::impl::registry_ref {
+    using registry_ref::registry_ref;
+};
+
+function_handle::function_handle(std::shared_ptr<impl> func_impl)
+    : pimpl{std::move(func_impl)}
+{}
+
+function_handle::function_handle(const function_handle &) noexcept = default;
+function_handle &function_handle::operator=(const function_handle &) noexcept = default;
+function_handle::function_handle(function_handle &&) noexcept = default;
+function_handle &function_handle::operator=(function_handle &&) noexcept = default;
+function_handle::~function_handle() = default;
+
+lua_State *function_handle::push_function(int nargs) {
+    if (!pimpl->valid())
+        throw luastate_error{"function belongs to a lua state that was reset"};
+    auto L = pimpl->pstate->L;
+    if (!lua_checkstack(L, nargs + 1))
+        throw luastate_error{"cannot grow lua stack"};
+    pimpl->push();
+    return L;
+}
+
+void function_handle::call_pushed(int nargs, int nresults) {
+    auto L = pimpl->pstate->L;
+    auto timing = pimpl->pstate->inst.time_function();
+    if (lua_pcall(L, nargs, nresults, 0) != LUA_OK)
+        throw luastate_error{std::get<1>(pimpl->pstate->pop_error())};
+}
+
+template<>
+function_handle lua_interpreter::get_global<types::FUNC>(keytype_t<var_where::GLOBAL> varname) {
+    pimpl->push_function<var_where::GLOBAL>(varname, IGNORED);
+    return {std::make_shared<function_handle::impl>(pimpl)};
+}
+
+template<types Type>
+get_var_t<Type> native::result(lua_State *L, int idx, int n) {
+    if (!value_ops<Type>::check(L, idx)) {
+        lua_interpreter::impl::of(L).inst.count_type_error();
+        throw luastate_error{std::string{"result #"} + std::to_string(n) + " ("
+            + value_ops<Type>::what() + " expected, got " + luaL_typename(L, idx) + ")"};
+    }
+    // results are popped right after
+    if constexpr (Type == types::STRVIEW) {
+        auto &state = lua_interpreter::impl::of(L);
+        state.require_view_guard();
+        return state.pin_view(idx);
+    } else {
+        return value_ops<Type>::convert(L, idx);
+    }
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template get_var_t<types::INT> native::result<types::INT>(lua_State *, int, int);
+template get_var_t<types::NUM> native::result<types::NUM>(lua_State *, int, int);
+template get_var_t<types::STR> native::result<types::STR>(lua_State *, int, int);
+template get_var_t<types::STRVIEW> native::result<types::STRVIEW>(lua_State *, int, int);
+template get_var_t<types::BOOL> native::result<types::BOOL>(lua_State *, int, int);
+template get_var_t<types::LTYPE> native::result<types::LTYPE>(lua_State *, int, int);
+
+void native::pop(lua_State *L, int n) noexcept {
+    lua_pop(L, n);
+}
+
+void native::push_arg(lua_State *L, const char *value) {
+    lua_pushstring(L, value);
+}
+
+int native::top(lua_State *L) noexcept {
+    return lua_gettop(L);
+}
+
+void native::settop(lua_State *L, int idx) noexcept {
+    lua_settop(L, idx);
+}
+
+void native::new_table(lua_State *L, std::size_t narr, std::size_t nrec) {
+    // the table, a key and a value, nested tables check again
+    if (!lua_checkstack(L, 3))
+        throw luastate_error{"lua stack overflow"};
+    constexpr auto max_hint = static_cast<std::size_t>(std::numeric_limits<int>::max());
+    lua_createtable(L, static_cast<int>(std::min(narr, max_hint)), static_cast<int>(std::min(nrec, max_hint)));
+}
+
+void native::set_field(lua_State *L, const char *name) {
+    // key below the value for lua_rawset
+    lua_pushstring(L, name);
+    lua_insert(L, -2);
+    lua_rawset(L, -3);
+}
+
+void native::set_index(lua_State *L, long long idx) {
+    lua_rawseti(L, -2, idx);
+}
+
+void native::set_pair(lua_State *L) {
+    lua_rawset(L, -3);
+}
+
+bool native::is_table(lua_State *L, int idx) noexcept {
+    return lua_istable(L, idx);
+}
+
+void native::set_pushed(lua_State *L, int idx, const char *key) noexcept {
+    lua_setfield(L, idx, key);
+}
+
+void native::set_pushed(lua_State *L, int idx, long long key) noexcept {
+    lua_seti(L, idx, key);
+}
+
+void native::reserve_field(lua_State *L) {
+    // the field, nested tables check again
+    if (!lua_checkstack(L, 1))
+        throw luastate_error{"lua stack overflow"};
+}
+
+void native::reserve_values(lua_State *L, int n) {
+    if (!lua_checkstack(L, n))
+        throw luastate_error{"lua stack overflow"};
+}
+
+void native::get_field(lua_State *L, int idx, const char *name) {
+    lua_getfield(L, idx, name);
+}
+
+void native::raw_get_index(lua_State *L, int idx, long long i) noexcept {
+    lua_rawgeti(L, idx, i);
+}
+
+std::size_t native::raw_len(lua_State *L, int idx) noexcept {
+    return lua_rawlen(L, idx);
+}
+
+bool native::to_value(lua_State *L, int idx, long long &out) noexcept {
+    if (!value_ops<types::INT>::check(L, idx))
+        return false;
+    out = value_ops<types::INT>::convert(L, idx);
+    return true;
+}
+
+bool native::to_value(lua_State *L, int idx, double &out) noexcept {
+    if (!value_ops<types::NUM>::check(L, idx))
+        return false;
+    out = value_ops<types::NUM>::convert(L, idx);
+    return true;
+}
+
+bool native::to_value(lua_State *L, int idx, std::string &out) {
+    if (!value_ops<types::STR>::check(L, idx))
+        return false;
+    auto len = std::size_t{};
+    auto str = lua_tolstring(L, idx, &len);
+    out.assign(str, len);
+    return true;
+}
+
+bool native::to_value(lua_State *L, int idx, bool &out) noexcept {
+    if (!value_ops<types::BOOL>::check(L, idx))
+        return false;
+    out = value_ops<types::BOOL>::convert(L, idx);
+    return true;
+}
+
+const char *native::type_what(types type) noexcept {
+    return ::type_what(type);
+}
+
+std::string native::key_path(const char *key) {
+    return std::string{"["} + key + "]";
+}
+
+std::string native::key_path(long long key) {
+    return "[" + std::to_string(key) + "]";
+}
+
+lua_State *lua_interpreter::native_state() const noexcept {
+    return pimpl->L;
+}
+
+int lua_interpreter::push_cached(const char *code) {
+    return pimpl->push_cached_chunk(code);
+}
+
+void lua_interpreter::set_global_pushed(const char *varname) noexcept {
+    lua_setglobal(pimpl->L, varname);
+}
+
+struct table_handle::impl {
+    std::shared_ptr<lua_interpreter::impl> pstate;
+    // own a reference to the parent impl to avoid popping stack even if parent itself is freed
+    std::shared_ptr<impl> parent;
+    // where is the current table on the stack
+    int stack_index;
+
+    // creation assumes table is already on the top of the stack
+    // currently the creation of table handle is managed by get_global, get_field, get_index functions,
+    // which takes care of pushing
+    // the destruction of table handle is managed by the destructor of this class
+    // beware
+    impl(std::shared_ptr<lua_interpreter::impl> &&interp_impl, std::shared_ptr<impl> &&parent_impl)
+        : pstate{std::move(interp_impl)}, parent{std::move(parent_impl)}
         , stack_index{pstate->get_top_idx()}
     {}
 
@@ -280,6 +1722,12 @@ table_handle::table_handle(std::shared_ptr<lua_interpreter::impl> interp_impl, s
 table_handle::table_handle(table_handle &&) noexcept = default;
 table_handle &table_handle::operator=(table_handle &&) noexcept = default;
 
+lua_State *table_handle::locate(int &idx) {
+    check_stack();
+    idx = pimpl->stack_index;
+    return pimpl->pstate->L;
+}
+
 template<types Type>
 get_var_t<Type> table_handle::get_field(keytype_t<var_where::TABLE> varname) {
     return pimpl->pstate->get_what<var_where::TABLE, Type>(varname, pimpl->stack_index);
@@ -289,6 +1737,7 @@ get_var_t<Type> table_handle::get_field(keytype_t<var_where::TABLE> varname) {
 template get_var_t<types::INT> table_handle::get_field<types::INT>(keytype_t<var_where::TABLE>);
 template get_var_t<types::NUM> table_handle::get_field<types::NUM>(keytype_t<var_where::TABLE>);
 template get_var_t<types::STR> table_handle::get_field<types::STR>(keytype_t<var_where::TABLE>);
+template get_var_t<types::STRVIEW> table_handle::get_field<types::STRVIEW>(keytype_t<var_where::TABLE>);
 template get_var_t<types::BOOL> table_handle::get_field<types::BOOL>(keytype_t<var_where::TABLE>);
 template get_var_t<types::LTYPE> table_handle::get_field<types::LTYPE>(keytype_t<var_where::TABLE>);
 
@@ -298,6 +1747,64 @@ table_handle table_handle::get_field<types::TABLE>(keytype_t<var_where::TABLE> v
     return {pimpl->pstate, pimpl};
 }
 
+template<>
+function_handle table_handle::get_field<types::FUNC>(keytype_t<var_where::TABLE> varname) {
+    pimpl->pstate->push_function<var_where::TABLE>(varname, pimpl->stack_index);
+    return {std::make_shared<function_handle::impl>(pimpl->pstate)};
+}
+
+template<types Type>
+lookup_result<Type> table_handle::try_get_field(keytype_t<var_where::TABLE> varname) {
+    return pimpl->pstate->try_get_what<var_where::TABLE, Type>(varname, pimpl->stack_index);
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template lookup_result<types::INT> table_handle::try_get_field<types::INT>(keytype_t<var_where::TABLE>);
+template lookup_result<types::NUM> table_handle::try_get_field<types::NUM>(keytype_t<var_where::TABLE>);
+template lookup_result<types::STR> table_handle::try_get_field<types::STR>(keytype_t<var_where::TABLE>);
+template lookup_result<types::STRVIEW> table_handle::try_get_field<types::STRVIEW>(keytype_t<var_where::TABLE>);
+template lookup_result<types::BOOL> table_handle::try_get_field<types::BOOL>(keytype_t<var_where::TABLE>);
+
+template<types Type>
+lookup_result<Type> table_handle::try_get_index(keytype_t<var_where::TABLE_INDEX> idx) {
+    return pimpl->pstate->try_get_what<var_where::TABLE_INDEX, Type>(idx, pimpl->stack_index);
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template lookup_result<types::INT> table_handle::try_get_index<types::INT>(keytype_t<var_where::TABLE_INDEX>);
+template lookup_result<types::NUM> table_handle::try_get_index<types::NUM>(keytype_t<var_where::TABLE_INDEX>);
+template lookup_result<types::STR> table_handle::try_get_index<types::STR>(keytype_t<var_where::TABLE_INDEX>);
+template lookup_result<types::STRVIEW> table_handle::try_get_index<types::STRVIEW>(keytype_t<var_where::TABLE_INDEX>);
+template lookup_result<types::BOOL> table_handle::try_get_index<types::BOOL>(keytype_t<var_where::TABLE_INDEX>);
+
+template<types Type>
+bool table_handle::get_field_unchecked(keytype_t<var_where::TABLE> varname, get_var_t<Type> &out) {
+    return pimpl->pstate->get_field_unchecked<Type>(varname, pimpl->stack_index, out);
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template bool table_handle::get_field_unchecked<types::INT>(keytype_t<var_where::TABLE>, get_var_t<types::INT> &);
+template bool table_handle::get_field_unchecked<types::NUM>(keytype_t<var_where::TABLE>, get_var_t<types::NUM> &);
+template bool table_handle::get_field_unchecked<types::STR>(keytype_t<var_where::TABLE>, get_var_t<types::STR> &);
+template bool table_handle::get_field_unchecked<types::STRVIEW>(keytype_t<var_where::TABLE>, get_var_t<types::STRVIEW> &);
+template bool table_handle::get_field_unchecked<types::BOOL>(keytype_t<var_where::TABLE>, get_var_t<types::BOOL> &);
+template bool table_handle::get_field_unchecked<types::LTYPE>(keytype_t<var_where::TABLE>, get_var_t<types::LTYPE> &);
+
+void table_handle::check_stack() {
+    pimpl->pstate->protect_indexing(pimpl->stack_index);
+}
+
+void native::throw_fields_error(const char *const *varnames, const types *wanted,
+    const bool *found, std::size_t n)
+{
+    auto msg = std::string{"fields"};
+    for (auto i = std::size_t{}; i < n; ++i)
+        if (!found[i])
+            msg = msg + " [" + varnames[i] + "] is not " + type_what(wanted[i]) + ",";
+    msg.pop_back();
+    throw luastate_error{msg};
+}
+
 template<types Type>
 get_var_t<Type> table_handle::get_index(keytype_t<var_where::TABLE_INDEX> idx) {
     return pimpl->pstate->get_what<var_where::TABLE_INDEX, Type>(idx, pimpl->stack_index);
@@ -307,6 +1814,7 @@ get_var_t<Type> table_handle::get_index(keytype_t<var_where::TABLE_INDEX> idx) {
 template get_var_t<types::INT> table_handle::get_index<types::INT>(keytype_t<var_where::TABLE_INDEX>);
 template get_var_t<types::NUM> table_handle::get_index<types::NUM>(keytype_t<var_where::TABLE_INDEX>);
 template get_var_t<types::STR> table_handle::get_index<types::STR>(keytype_t<var_where::TABLE_INDEX>);
+template get_var_t<types::STRVIEW> table_handle::get_index<types::STRVIEW>(keytype_t<var_where::TABLE_INDEX>);
 template get_var_t<types::BOOL> table_handle::get_index<types::BOOL>(keytype_t<var_where::TABLE_INDEX>);
 template get_var_t<types::LTYPE> table_handle::get_index<types::LTYPE>(keytype_t<var_where::TABLE_INDEX>);
 
@@ -316,6 +1824,467 @@ table_handle table_handle::get_index<types::TABLE>(keytype_t<var_where::TABLE_IN
     return {pimpl->pstate, pimpl};
 }
 
+template<types Type>
+std::vector<get_var_t<Type>> table_handle::to_vector() {
+    return pimpl->pstate->array_to_vector<Type>(pimpl->stack_index);
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template std::vector<get_var_t<types::INT>> table_handle::to_vector<types::INT>();
+template std::vector<get_var_t<types::NUM>> table_handle::to_vector<types::NUM>();
+template std::vector<get_var_t<types::STR>> table_handle::to_vector<types::STR>();
+template std::vector<get_var_t<types::BOOL>> table_handle::to_vector<types::BOOL>();
+
+template<types Type>
+std::size_t table_handle::copy_into(get_var_t<Type> *buf, std::size_t bufsize) {
+    return pimpl->pstate->array_copy_into<Type>(pimpl->stack_index, buf, bufsize);
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template std::size_t table_handle::copy_into<types::INT>(get_var_t<types::INT> *, std::size_t);
+template std::size_t table_handle::copy_into<types::NUM>(get_var_t<types::NUM> *, std::size_t);
+template std::size_t table_handle::copy_into<types::STR>(get_var_t<types::STR> *, std::size_t);
+template std::size_t table_handle::copy_into<types::BOOL>(get_var_t<types::BOOL> *, std::size_t);
+
+template<>
+function_handle table_handle::get_index<types::FUNC>(keytype_t<var_where::TABLE_INDEX> idx) {
+    pimpl->pstate->push_function<var_where::TABLE_INDEX>(idx, pimpl->stack_index);
+    return {std::make_shared<function_handle::impl>(pimpl->pstate)};
+}
+
+table_ref table_handle::to_ref() {
+    auto &state = *pimpl->pstate;
+    state.protect_indexing(pimpl->stack_index);
+    lua_pushvalue(state.L, pimpl->stack_index);
+    return {std::make_shared<table_ref::impl>(pimpl->pstate)};
+}
+
+bool table_handle::next_batch(table_batch &batch) {
+    return fill_batch(*pimpl, batch);
+}
+
+bool table_handle::fill_batch(impl &table, table_batch &batch) {
+    auto &state = *table.pstate;
+    auto L = state.L;
+    auto tidx = table.stack_index;
+    state.protect_indexing(tidx);
+    auto same = false;
+    if (batch.pstate == table.pstate && batch.generation == state.generation && batch.table_ref) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, batch.table_ref);
+        same = lua_rawequal(L, -1, tidx);
+        lua_pop(L, 1);
+    }
+    if (!same) {
+        batch.rewind();
+        batch.pstate = table.pstate;
+        batch.generation = state.generation;
+        // held for the whole traversal, so it cannot be collected and its address reused
+        lua_pushvalue(L, tidx);
+        batch.table_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    batch.entries.clear();
+    batch.chars.clear();
+    if (batch.done)
+        return false;
+
+    // copying can throw bad_alloc with a key and a value of lua_next() on the stack
+    auto top = lua_gettop(L);
+    auto more = false;
+    try {
+        if (batch.key_ref) {
+            // resume after the last key of the previous fill, which may be gone since
+            lua_pushcfunction(L, next_pair);
+            lua_pushvalue(L, tidx);
+            lua_rawgeti(L, LUA_REGISTRYINDEX, batch.key_ref);
+            if (lua_pcall(L, 2, 2, 0) != LUA_OK) {
+                auto msg = std::string{"table changed during batch traversal: "} + lua_tostring(L, -1);
+                lua_pop(L, 1);
+                throw luastate_error{msg};
+            }
+            more = !lua_isnil(L, -2);
+            if (!more)
+                lua_pop(L, 2);
+        } else {
+            lua_pushnil(L);
+            more = lua_next(L, tidx);
+        }
+        // keys from lua_next() itself are always valid
+        while (more) {
+            batch.entries.emplace_back();
+            auto &pair = batch.entries.back();
+            copy_value(L, -2, pair.key, batch.chars);
+            copy_value(L, -1, pair.value, batch.chars);
+            lua_pop(L, 1);
+            if (batch.entries.size() == batch.capacity)
+                break;
+            more = lua_next(L, tidx);
+        }
+    } catch (...) {
+        lua_settop(L, top);
+        // the next fill starts again after the last key kept
+        batch.entries.clear();
+        batch.chars.clear();
+        throw;
+    }
+    if (!more) {
+        batch.done = true;
+        batch.release_key();
+    } else {
+        // the last key is left on the stack
+        if (batch.key_ref)
+            lua_rawseti(L, LUA_REGISTRYINDEX, batch.key_ref);
+        else
+            batch.key_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    batch.relink();
+    return !batch.entries.empty();
+}
+
+table_handle::iterator table_handle::begin() {
+    return iterator{pimpl};
+}
+
+table_handle::iterator table_handle::end() noexcept {
+    return {};
+}
+
+table_handle::iterator::iterator() noexcept
+    : batch{1}, pos{}, passed{}
+{}
+
+table_handle::iterator::iterator(std::shared_ptr<table_handle::impl> table_impl)
+    : table{std::move(table_impl)}, batch{ITERATOR_BATCH}, pos{}, passed{}
+{
+    refill();
+}
+
+void table_handle::iterator::refill() {
+    pos = 0;
+    if (!fill_batch(*table, batch)) {
+        table.reset();
+        passed = 0;
+    }
+}
+
+table_batch::table_batch(std::size_t capacity) noexcept
+    : capacity{std::max(capacity, std::size_t{1})}
+    , table_ref{}, key_ref{}, done{}, generation{}
+{}
+
+table_batch::table_batch(const table_batch &other)
+    : entries{other.entries}, chars{other.chars}, capacity{other.capacity}
+    , pstate{other.pstate}, table_ref{}, key_ref{}, done{other.done}
+    , generation{other.generation}
+{
+    relink();
+    if (!pstate || pstate->generation != generation)
+        return;
+    auto copy_ref = [L = pstate->L](int ref) {
+        if (!ref)
+            return 0;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+        return luaL_ref(L, LUA_REGISTRYINDEX);
+    };
+    table_ref = copy_ref(other.table_ref);
+    key_ref = copy_ref(other.key_ref);
+}
+
+table_batch &table_batch::operator=(const table_batch &other) {
+    if (this != &other)
+        *this = table_batch{other};
+    return *this;
+}
+
+table_batch::table_batch(table_batch &&other) noexcept
+    : entries{std::move(other.entries)}, chars{std::move(other.chars)}, capacity{other.capacity}
+    , pstate{std::move(other.pstate)}, table_ref{std::exchange(other.table_ref, 0)}
+    , key_ref{std::exchange(other.key_ref, 0)}
+    , done{other.done}, generation{other.generation}
+{
+    // short strings do not keep their buffer when moved
+    relink();
+}
+
+table_batch &table_batch::operator=(table_batch &&other) noexcept {
+    if (this != &other) {
+        rewind();
+        entries = std::move(other.entries);
+        chars = std::move(other.chars);
+        capacity = other.capacity;
+        pstate = std::move(other.pstate);
+        table_ref = std::exchange(other.table_ref, 0);
+        key_ref = std::exchange(other.key_ref, 0);
+        done = other.done;
+        generation = other.generation;
+        relink();
+    }
+    return *this;
+}
+
+table_batch::~table_batch() {
+    rewind();
+}
+
+void table_batch::rewind() noexcept {
+    release_key();
+    if (table_ref && pstate->generation == generation)
+        luaL_unref(pstate->L, LUA_REGISTRYINDEX, table_ref);
+    table_ref = 0;
+    entries.clear();
+    chars.clear();
+    done = false;
+}
+
+void table_batch::relink() noexcept {
+    auto at = chars.data();
+    for (auto &pair : entries)
+        for (auto value : {&pair.key, &pair.value})
+            if (value->type == types::STR) {
+                value->string = {at, value->string.size()};
+                at += value->string.size();
+            }
+}
+
+void table_batch::release_key() noexcept {
+    if (key_ref && pstate->generation == generation)
+        luaL_unref(pstate->L, LUA_REGISTRYINDEX, key_ref);
+    key_ref = 0;
+}
+
+void table_value::throw_mismatch(types wanted) const {
+    throw luastate_error{std::string{"table value is not "} + type_what(wanted)};
+}
+
+table_frame lua_interpreter::frame_global(keytype_t<var_where::GLOBAL> varname) {
+    pimpl->push_table<var_where::GLOBAL>(varname, IGNORED);
+    return {pimpl.get(), pimpl->L};
+}
+
+void table_frame::pop(lua_State *L, int stack_index) noexcept {
+    if (lua_gettop(L) >= stack_index)
+        lua_settop(L, stack_index - 1);
+}
+
+void table_frame::check_stack() {
+    state->protect_indexing(stack_index);
+}
+
+lua_State *table_frame::locate(int &idx) {
+    check_stack();
+    idx = stack_index;
+    return L;
+}
+
+template<types Type>
+bool table_frame::get_field_unchecked(keytype_t<var_where::TABLE> varname, get_var_t<Type> &out) {
+    return state->get_field_unchecked<Type>(varname, stack_index, out);
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template bool table_frame::get_field_unchecked<types::INT>(keytype_t<var_where::TABLE>, get_var_t<types::INT> &);
+template bool table_frame::get_field_unchecked<types::NUM>(keytype_t<var_where::TABLE>, get_var_t<types::NUM> &);
+template bool table_frame::get_field_unchecked<types::STR>(keytype_t<var_where::TABLE>, get_var_t<types::STR> &);
+template bool table_frame::get_field_unchecked<types::STRVIEW>(keytype_t<var_where::TABLE>, get_var_t<types::STRVIEW> &);
+template bool table_frame::get_field_unchecked<types::BOOL>(keytype_t<var_where::TABLE>, get_var_t<types::BOOL> &);
+template bool table_frame::get_field_unchecked<types::LTYPE>(keytype_t<var_where::TABLE>, get_var_t<types::LTYPE> &);
+
+template<types Type>
+get_var_t<Type> table_frame::get_field(keytype_t<var_where::TABLE> varname) {
+    return state->get_what<var_where::TABLE, Type>(varname, stack_index);
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template get_var_t<types::INT> table_frame::get_field<types::INT>(keytype_t<var_where::TABLE>);
+template get_var_t<types::NUM> table_frame::get_field<types::NUM>(keytype_t<var_where::TABLE>);
+template get_var_t<types::STR> table_frame::get_field<types::STR>(keytype_t<var_where::TABLE>);
+template get_var_t<types::STRVIEW> table_frame::get_field<types::STRVIEW>(keytype_t<var_where::TABLE>);
+template get_var_t<types::BOOL> table_frame::get_field<types::BOOL>(keytype_t<var_where::TABLE>);
+template get_var_t<types::LTYPE> table_frame::get_field<types::LTYPE>(keytype_t<var_where::TABLE>);
+
+template<types Type>
+get_var_t<Type> table_frame::get_index(keytype_t<var_where::TABLE_INDEX> idx) {
+    return state->get_what<var_where::TABLE_INDEX, Type>(idx, stack_index);
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template get_var_t<types::INT> table_frame::get_index<types::INT>(keytype_t<var_where::TABLE_INDEX>);
+template get_var_t<types::NUM> table_frame::get_index<types::NUM>(keytype_t<var_where::TABLE_INDEX>);
+template get_var_t<types::STR> table_frame::get_index<types::STR>(keytype_t<var_where::TABLE_INDEX>);
+template get_var_t<types::STRVIEW> table_frame::get_index<types::STRVIEW>(keytype_t<var_where::TABLE_INDEX>);
+template get_var_t<types::BOOL> table_frame::get_index<types::BOOL>(keytype_t<var_where::TABLE_INDEX>);
+template get_var_t<types::LTYPE> table_frame::get_index<types::LTYPE>(keytype_t<var_where::TABLE_INDEX>);
+
+template<types Type>
+lookup_result<Type> table_frame::try_get_field(keytype_t<var_where::TABLE> varname) {
+    return state->try_get_what<var_where::TABLE, Type>(varname, stack_index);
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template lookup_result<types::INT> table_frame::try_get_field<types::INT>(keytype_t<var_where::TABLE>);
+template lookup_result<types::NUM> table_frame::try_get_field<types::NUM>(keytype_t<var_where::TABLE>);
+template lookup_result<types::STR> table_frame::try_get_field<types::STR>(keytype_t<var_where::TABLE>);
+template lookup_result<types::STRVIEW> table_frame::try_get_field<types::STRVIEW>(keytype_t<var_where::TABLE>);
+template lookup_result<types::BOOL> table_frame::try_get_field<types::BOOL>(keytype_t<var_where::TABLE>);
+
+template<types Type>
+lookup_result<Type> table_frame::try_get_index(keytype_t<var_where::TABLE_INDEX> idx) {
+    return state->try_get_what<var_where::TABLE_INDEX, Type>(idx, stack_index);
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template lookup_result<types::INT> table_frame::try_get_index<types::INT>(keytype_t<var_where::TABLE_INDEX>);
+template lookup_result<types::NUM> table_frame::try_get_index<types::NUM>(keytype_t<var_where::TABLE_INDEX>);
+template lookup_result<types::STR> table_frame::try_get_index<types::STR>(keytype_t<var_where::TABLE_INDEX>);
+template lookup_result<types::STRVIEW> table_frame::try_get_index<types::STRVIEW>(keytype_t<var_where::TABLE_INDEX>);
+template lookup_result<types::BOOL> table_frame::try_get_index<types::BOOL>(keytype_t<var_where::TABLE_INDEX>);
+
+LuaInt table_frame::len() {
+    return state->table_len(stack_index);
+}
+
+template<types Type>
+std::vector<get_var_t<Type>> table_frame::to_vector() {
+    return state->array_to_vector<Type>(stack_index);
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template std::vector<get_var_t<types::INT>> table_frame::to_vector<types::INT>();
+template std::vector<get_var_t<types::NUM>> table_frame::to_vector<types::NUM>();
+template std::vector<get_var_t<types::STR>> table_frame::to_vector<types::STR>();
+template std::vector<get_var_t<types::BOOL>> table_frame::to_vector<types::BOOL>();
+
+template<types Type>
+std::size_t table_frame::copy_into(get_var_t<Type> *buf, std::size_t bufsize) {
+    return state->array_copy_into<Type>(stack_index, buf, bufsize);
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template std::size_t table_frame::copy_into<types::INT>(get_var_t<types::INT> *, std::size_t);
+template std::size_t table_frame::copy_into<types::NUM>(get_var_t<types::NUM> *, std::size_t);
+template std::size_t table_frame::copy_into<types::STR>(get_var_t<types::STR> *, std::size_t);
+template std::size_t table_frame::copy_into<types::BOOL>(get_var_t<types::BOOL> *, std::size_t);
+
+table_frame table_frame::frame_field(keytype_t<var_where::TABLE> varname) {
+    state->push_table<var_where::TABLE>(varname, stack_index);
+    return {state, L};
+}
+
+table_frame table_frame::frame_index(keytype_t<var_where::TABLE_INDEX> idx) {
+    state->push_table<var_where::TABLE_INDEX>(idx, stack_index);
+    return {state, L};
+}
+
+struct table_ref::impl : lua_interpreter::impl::registry_ref {
+    using registry_ref::registry_ref;
+
+    // pushes the table, returns its stack index
+    // pop 0, push 1
+    int push_checked() const {
+        if (!valid())
+            throw luastate_error{"table belongs to a lua state that was reset"};
+        push();
+        return pstate->get_top_idx();
+    }
+};
+
+namespace {
+    // restores the stack top on scope exit
+    struct stack_guard {
+        lua_State *L;
+        int top;
+        ~stack_guard() { lua_settop(L, top); }
+    };
+}
+
+table_ref::table_ref(std::shared_ptr<impl> ref_impl)
+    : pimpl{std::move(ref_impl)}
+{}
+
+table_ref::table_ref(const table_ref &) noexcept = default;
+table_ref &table_ref::operator=(const table_ref &) noexcept = default;
+table_ref::table_ref(table_ref &&) noexcept = default;
+table_ref &table_ref::operator=(table_ref &&) noexcept = default;
+table_ref::~table_ref() = default;
+
+table_handle table_ref::push() const {
+    pimpl->push_checked();
+    return {pimpl->pstate, nullptr};
+}
+
+template<types Type>
+get_var_t<Type> table_ref::get_field(keytype_t<var_where::TABLE> varname) const {
+    auto &state = *pimpl->pstate;
+    auto guard = stack_guard{state.L, state.get_top_idx()};
+    return state.get_what<var_where::TABLE, Type>(varname, pimpl->push_checked());
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template get_var_t<types::INT> table_ref::get_field<types::INT>(keytype_t<var_where::TABLE>) const;
+template get_var_t<types::NUM> table_ref::get_field<types::NUM>(keytype_t<var_where::TABLE>) const;
+template get_var_t<types::STR> table_ref::get_field<types::STR>(keytype_t<var_where::TABLE>) const;
+template get_var_t<types::STRVIEW> table_ref::get_field<types::STRVIEW>(keytype_t<var_where::TABLE>) const;
+template get_var_t<types::BOOL> table_ref::get_field<types::BOOL>(keytype_t<var_where::TABLE>) const;
+template get_var_t<types::LTYPE> table_ref::get_field<types::LTYPE>(keytype_t<var_where::TABLE>) const;
+
+template<>
+function_handle table_ref::get_field<types::FUNC>(keytype_t<var_where::TABLE> varname) const {
+    auto &state = *pimpl->pstate;
+    auto guard = stack_guard{state.L, state.get_top_idx()};
+    state.push_function<var_where::TABLE>(varname, pimpl->push_checked());
+    return {std::make_shared<function_handle::impl>(pimpl->pstate)};
+}
+
+template<types Type>
+get_var_t<Type> table_ref::get_index(keytype_t<var_where::TABLE_INDEX> idx) const {
+    auto &state = *pimpl->pstate;
+    auto guard = stack_guard{state.L, state.get_top_idx()};
+    return state.get_what<var_where::TABLE_INDEX, Type>(idx, pimpl->push_checked());
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template get_var_t<types::INT> table_ref::get_index<types::INT>(keytype_t<var_where::TABLE_INDEX>) const;
+template get_var_t<types::NUM> table_ref::get_index<types::NUM>(keytype_t<var_where::TABLE_INDEX>) const;
+template get_var_t<types::STR> table_ref::get_index<types::STR>(keytype_t<var_where::TABLE_INDEX>) const;
+template get_var_t<types::STRVIEW> table_ref::get_index<types::STRVIEW>(keytype_t<var_where::TABLE_INDEX>) const;
+template get_var_t<types::BOOL> table_ref::get_index<types::BOOL>(keytype_t<var_where::TABLE_INDEX>) const;
+template get_var_t<types::LTYPE> table_ref::get_index<types::LTYPE>(keytype_t<var_where::TABLE_INDEX>) const;
+
+template<>
+function_handle table_ref::get_index<types::FUNC>(keytype_t<var_where::TABLE_INDEX> idx) const {
+    auto &state = *pimpl->pstate;
+    auto guard = stack_guard{state.L, state.get_top_idx()};
+    state.push_function<var_where::TABLE_INDEX>(idx, pimpl->push_checked());
+    return {std::make_shared<function_handle::impl>(pimpl->pstate)};
+}
+
+template<types Type>
+lookup_result<Type> table_ref::try_get_field(keytype_t<var_where::TABLE> varname) const {
+    auto &state = *pimpl->pstate;
+    auto guard = stack_guard{state.L, state.get_top_idx()};
+    return state.try_get_what<var_where::TABLE, Type>(varname, pimpl->push_checked());
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template lookup_result<types::INT> table_ref::try_get_field<types::INT>(keytype_t<var_where::TABLE>) const;
+template lookup_result<types::NUM> table_ref::try_get_field<types::NUM>(keytype_t<var_where::TABLE>) const;
+template lookup_result<types::STR> table_ref::try_get_field<types::STR>(keytype_t<var_where::TABLE>) const;
+template lookup_result<types::STRVIEW> table_ref::try_get_field<types::STRVIEW>(keytype_t<var_where::TABLE>) const;
+template lookup_result<types::BOOL> table_ref::try_get_field<types::BOOL>(keytype_t<var_where::TABLE>) const;
+
+template<types Type>
+lookup_result<Type> table_ref::try_get_index(keytype_t<var_where::TABLE_INDEX> idx) const {
+    auto &state = *pimpl->pstate;
+    auto guard = stack_guard{state.L, state.get_top_idx()};
+    return state.try_get_what<var_where::TABLE_INDEX, Type>(idx, pimpl->push_checked());
+}
+
+// EXPLICIT INSTANTIATION for basic types
+template lookup_result<types::INT> table_ref::try_get_index<types::INT>(keytype_t<var_where::TABLE_INDEX>) const;
+template lookup_result<types::NUM> table_ref::try_get_index<types::NUM>(keytype_t<var_where::TABLE_INDEX>) const;
+template lookup_result<types::STR> table_ref::try_get_index<types::STR>(keytype_t<var_where::TABLE_INDEX>) const;
+template lookup_result<types::STRVIEW> table_ref::try_get_index<types::STRVIEW>(keytype_t<var_where::TABLE_INDEX>) const;
+template lookup_result<types::BOOL> table_ref::try_get_index<types::BOOL>(keytype_t<var_where::TABLE_INDEX>) const;
+
 LuaInt table_handle::len() {
     return pimpl->pstate->table_len(pimpl->stack_index);
 }
@@ -1,9 +1,26 @@
 #pragma once
 
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <iterator>
+#include <limits>
+#include <map>
 #include <memory>
+#include <new>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// opaque here, only native functions see it
+struct lua_State;
 
 namespace luai {
 
@@ -11,12 +28,112 @@ class luastate_error : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
+// STRVIEW is a STR read without copying, see view_guard
 enum class types {
     INT, NUM, STR, BOOL, TABLE,
-    NIL, OTHER, LTYPE
+    NIL, OTHER, LTYPE,
+    FUNC, STRVIEW
 };
 
 class table_handle;
+class table_frame;
+class table_ref;
+class function_handle;
+class chunk_handle;
+
+// counters of the compiled chunk cache, see lua_interpreter::load_chunk()
+struct chunk_cache_stats {
+    std::size_t hits;
+    std::size_t misses;
+    std::size_t evictions;
+    // number of chunks and total source bytes currently cached
+    std::size_t entries;
+    std::size_t bytes;
+};
+
+// memory counters of a lua state
+struct alloc_stats {
+    // blocks allocated or resized, blocks released
+    std::size_t allocations;
+    std::size_t frees;
+    std::size_t bytes_in_use;
+    std::size_t peak_bytes;
+};
+
+// limits of one budgeted run, see lua_interpreter::run_chunk(const char *, const exec_budget &)
+// 0 means no limit. instructions and wall_time are checked by a count hook every
+// hook_interval vm instructions: a smaller interval stops closer to the limit, a larger one
+// costs less. memory is enforced by the allocator, so without the other two no hook is set
+struct exec_budget {
+    std::size_t instructions {};
+    std::chrono::nanoseconds wall_time {};
+    // bytes the state may grow by during the run
+    std::size_t memory {};
+    int hook_interval {1000};
+};
+
+// which limit of an exec_budget stopped a run
+enum class budget_error {
+    NONE, INSTRUCTIONS, WALL_TIME, MEMORY
+};
+
+// durations in power of two buckets: bucket i counts durations of [2^i, 2^(i+1)) ns
+struct latency_histogram {
+    static constexpr std::size_t BUCKETS = 40;
+    std::array<std::uint64_t, BUCKETS> buckets;
+    std::uint64_t count;
+    std::uint64_t total_ns;
+    std::uint64_t max_ns;
+
+    // upper bound of the bucket holding quantile q (0..1) of the durations, 0 if empty
+    std::uint64_t quantile_ns(double q) const noexcept;
+};
+
+// samples of the profiler at one line of lua code
+struct profile_entry {
+    // "short_src:line"
+    std::string location;
+    std::uint64_t samples;
+};
+
+// instrumentation of a state, see lua_interpreter::get_instruments()
+// only collected when built with LUAI_INSTRUMENT defined, otherwise every field is zero
+struct instrument_snapshot {
+    bool enabled;
+    // variables and fields read through get_global(), get_field(), get_index()...
+    std::uint64_t get_calls;
+    // luastate_errors thrown because a value was missing or had the wrong type
+    std::uint64_t type_errors;
+    // c++ functions called from lua, lua functions called through function_handle
+    std::uint64_t native_calls;
+    std::uint64_t function_calls;
+    std::uint64_t chunk_runs;
+    // deepest lua stack seen when reading values
+    int max_stack_depth;
+    // bytes requested from the allocator in total
+    std::uint64_t bytes_allocated;
+    // chunk runs include compiling, function calls exclude converting the results
+    latency_histogram run_chunk;
+    latency_histogram function_call;
+    // profiler samples, most sampled first
+    std::vector<profile_entry> hot_spots;
+};
+
+// memory policy of a lua state, see allocators.hxx for the built-in ones
+// one instance must serve only one state at a time, it is not synchronized
+class allocator {
+public:
+    // same contract as lua_Alloc: frees ptr when nsize is 0, otherwise returns a block of
+    // nsize bytes holding the first min(osize, nsize) bytes of ptr, or nullptr on failure.
+    // if ptr is nullptr, osize is not a size but a lua type tag and should be ignored
+    virtual void *realloc(void *ptr, std::size_t osize, std::size_t nsize) noexcept = 0;
+
+    // called by lua_interpreter::reset() once the old state is closed,
+    // so memory can be released all at once
+    virtual void reset() noexcept {}
+
+    virtual ~allocator() = default;
+};
 
 // all possible types one can get from state.get_global(),  get_field() and get_index()
 template<types Type>
@@ -24,11 +141,643 @@ using get_var_t =
     std::conditional_t<Type == types::INT, long long,
     std::conditional_t<Type == types::NUM, double,
     std::conditional_t<Type == types::STR, std::string,
+    std::conditional_t<Type == types::STRVIEW, std::string_view,
     std::conditional_t<Type == types::BOOL, bool,
     std::conditional_t<Type == types::TABLE, table_handle,
+    std::conditional_t<Type == types::FUNC, function_handle,
     std::conditional_t<Type == types::LTYPE, types,
     /*unsupported types*/ luastate_error
->>>>>>;
+>>>>>>>>;
+
+// why try_get_global(), try_get_field() or try_get_index() found no value
+enum class lookup_error {
+    NONE, MISSING, WRONG_TYPE
+};
+
+// what a failed lookup knows, the message is only built when asked for
+class lookup_status {
+public:
+    lookup_error error() const noexcept { return err; }
+
+    // type of the value found instead, types::NIL if missing
+    types found() const noexcept { return got; }
+
+    // the message the throwing getter would have given. a key given by name must still
+    // be alive when this is called
+    std::string message() const;
+
+protected:
+    lookup_error err {lookup_error::NONE};
+    types wanted;
+    types got {types::NIL};
+    // by name if name is not null, by index otherwise
+    const char *name;
+    long long index {};
+
+    lookup_status(types wanted, const char *name) noexcept : wanted{wanted}, name{name} {}
+    lookup_status(types wanted, long long index) noexcept : wanted{wanted}, name{nullptr}, index{index} {}
+
+    [[noreturn]] void throw_error() const;
+
+    friend class lua_interpreter;
+};
+
+// result of a lookup that does not throw if the value is missing or of another type:
+// if (auto port = tbl.try_get_field<types::INT>("port")) use(*port);
+// auto port = tbl.try_get_field<types::INT>("port").value_or(8080);
+// nothing is allocated on failure. basic types except LTYPE, which never fails
+template<types Type>
+class lookup_result : public lookup_status {
+public:
+    explicit operator bool() const noexcept { return err == lookup_error::NONE; }
+    bool has_value() const noexcept { return err == lookup_error::NONE; }
+
+    // only if there is a value
+    const get_var_t<Type> &operator*() const noexcept { return val; }
+    const get_var_t<Type> *operator->() const noexcept { return &val; }
+
+    // throws luastate_error with message() if there is no value
+    const get_var_t<Type> &value() const {
+        if (err != lookup_error::NONE)
+            throw_error();
+        return val;
+    }
+
+    template<class U>
+    get_var_t<Type> value_or(U &&fallback) const {
+        if (err != lookup_error::NONE)
+            return static_cast<get_var_t<Type>>(std::forward<U>(fallback));
+        return val;
+    }
+
+private:
+    get_var_t<Type> val {};
+
+    using lookup_status::lookup_status;
+
+    friend class lua_interpreter;
+};
+
+// c++ type -> types, the reverse of get_var_t for the basic types
+// used to marshal arguments and results of native functions
+template<class T, class = void>
+struct type_of;
+
+template<class T>
+struct type_of<T, std::enable_if_t<std::is_integral<T>::value && !std::is_same<T, bool>::value>>
+    : std::integral_constant<types, types::INT> {};
+
+template<class T>
+struct type_of<T, std::enable_if_t<std::is_floating_point<T>::value>>
+    : std::integral_constant<types, types::NUM> {};
+
+template<>
+struct type_of<std::string> : std::integral_constant<types, types::STR> {};
+
+// native function arguments of this type point into the lua stack, no copy is made
+template<>
+struct type_of<std::string_view> : std::integral_constant<types, types::STRVIEW> {};
+
+template<>
+struct type_of<bool> : std::integral_constant<types, types::BOOL> {};
+
+template<class T>
+constexpr types type_of_v = type_of<std::decay_t<T>>::value;
+
+// used by the trampolines generated by lua_interpreter::register_function()
+namespace native {
+    // the callable bound to the running native function
+    void *target(lua_State *L) noexcept;
+
+    // converts argument idx, throws luastate_error if it does not have the type
+    template<types Type>
+    get_var_t<Type> arg(lua_State *L, int idx);
+
+    template<types Type>
+    void push(lua_State *L, const get_var_t<Type> &value);
+
+    // defined in lua_interpreter.cxx
+    template<> void push<types::INT>(lua_State *L, const get_var_t<types::INT> &value);
+    template<> void push<types::NUM>(lua_State *L, const get_var_t<types::NUM> &value);
+    template<> void push<types::STR>(lua_State *L, const get_var_t<types::STR> &value);
+    template<> void push<types::STRVIEW>(lua_State *L, const get_var_t<types::STRVIEW> &value);
+    template<> void push<types::BOOL>(lua_State *L, const get_var_t<types::BOOL> &value);
+
+    // converts result n of a function_handle call at stack index idx,
+    // throws luastate_error if it does not have the type
+    template<types Type>
+    get_var_t<Type> result(lua_State *L, int idx, int n);
+
+    // raises msg as lua error, does not return
+    [[noreturn]] void raise(lua_State *L, const char *msg);
+
+    void pop(lua_State *L, int n) noexcept;
+    int top(lua_State *L) noexcept;
+    void settop(lua_State *L, int idx) noexcept;
+
+    // used by to_lua. new_table() pushes a table presized for narr array elements and
+    // nrec other fields. set_field(), set_index() and set_pair() pop the value (and key)
+    // on the top into the table below them with raw access
+    void new_table(lua_State *L, std::size_t narr, std::size_t nrec);
+    void set_field(lua_State *L, const char *name);
+    void set_index(lua_State *L, long long idx);
+    void set_pair(lua_State *L);
+
+    // used by from_lua. get_field() pushes t[name] of the table at idx, raw_get_index() t[i]
+    // with raw access. to_value() converts the value at idx like get_field() would,
+    // returns false if it does not have the type. reserve_field() makes room for the value
+    // a table read pushes, reserve_values() for n values about to be pushed, both throw
+    // luastate_error if the stack cannot grow
+    bool is_table(lua_State *L, int idx) noexcept;
+    void reserve_field(lua_State *L);
+    void reserve_values(lua_State *L, int n);
+    void get_field(lua_State *L, int idx, const char *name);
+    void raw_get_index(lua_State *L, int idx, long long i) noexcept;
+    std::size_t raw_len(lua_State *L, int idx) noexcept;
+    bool to_value(lua_State *L, int idx, long long &out) noexcept;
+    bool to_value(lua_State *L, int idx, double &out) noexcept;
+    bool to_value(lua_State *L, int idx, std::string &out);
+    bool to_value(lua_State *L, int idx, bool &out) noexcept;
+    // name of the expected type in error messages
+    const char *type_what(types type) noexcept;
+
+    // whether the number value converts to T without narrowing
+    template<class T, class V>
+    constexpr bool fits(V value) noexcept {
+        using limits = std::numeric_limits<T>;
+        if constexpr (std::is_same<T, V>::value) {
+            return true;
+        } else if constexpr (std::is_floating_point<T>::value) {
+            // infinities and nan carry over
+            return !(value < -limits::max() || value > limits::max())
+                || value == limits::infinity() || value == -limits::infinity();
+        } else if constexpr (std::is_signed<V>::value) {
+            if (value < 0)
+                return std::is_signed<T>::value && value >= limits::min();
+            return static_cast<unsigned long long>(value) <= static_cast<unsigned long long>(limits::max());
+        } else {
+            return static_cast<unsigned long long>(value) <= static_cast<unsigned long long>(limits::max());
+        }
+    }
+
+    // throws luastate_error for argument idx of a native function, or a pushed integer,
+    // that does not fit the c++ or lua integer type
+    [[noreturn]] void throw_arg_range(int idx);
+    [[noreturn]] void throw_push_range();
+
+    // argument idx of a native function as its parameter type P. integers that do not fit
+    // P are an argument error instead of being narrowed
+    template<class P>
+    get_var_t<type_of_v<P>> param(lua_State *L, int idx) {
+        auto value = arg<type_of_v<P>>(L, idx);
+        if constexpr (type_of_v<P> == types::INT) {
+            if (!fits<std::decay_t<P>>(value))
+                throw_arg_range(idx);
+        }
+        return value;
+    }
+
+    // push<type_of_v<T>>(), throws luastate_error for unsigned integers above the
+    // largest lua integer instead of wrapping them
+    template<class T>
+    void push_value(lua_State *L, const T &value) {
+        if constexpr (type_of_v<T> == types::INT) {
+            if (!fits<long long>(value))
+                throw_push_range();
+        }
+        push<type_of_v<T>>(L, value);
+    }
+
+    // arguments of function_handle::call()
+    template<class T>
+    void push_arg(lua_State *L, const T &value) {
+        push_value(L, value);
+    }
+    // so that string literals are not copied into a std::string first
+    void push_arg(lua_State *L, const char *value);
+
+    // results of function_handle::call() -> c++: nothing, one value or a tuple
+    template<types... Results>
+    struct returns {
+        using type = std::tuple<get_var_t<Results>...>;
+
+        static type get(lua_State *L) {
+            return get(L, std::make_index_sequence<sizeof...(Results)>{});
+        }
+
+        // braced init converts in order
+        template<std::size_t... Is>
+        static type get(lua_State *L, std::index_sequence<Is...>) {
+            constexpr int n = sizeof...(Results);
+            return type{result<Results>(L, static_cast<int>(Is) - n, static_cast<int>(Is) + 1)...};
+        }
+    };
+
+    template<types Result>
+    struct returns<Result> {
+        using type = get_var_t<Result>;
+
+        static type get(lua_State *L) {
+            return result<Result>(L, -1, 1);
+        }
+    };
+
+    template<>
+    struct returns<> {
+        using type = void;
+
+        static void get(lua_State *) {}
+    };
+
+    // pops the results of a call however reading them ends
+    struct pop_guard {
+        lua_State *L;
+        int n;
+        ~pop_guard() { pop(L, n); }
+    };
+
+    // result of f(args...) -> lua results, returns the number of results
+    template<class R>
+    struct results {
+        template<class F, class... Args>
+        static int call(lua_State *L, F &f, Args &&...args) {
+            push_value(L, f(std::forward<Args>(args)...));
+            return 1;
+        }
+    };
+
+    template<>
+    struct results<void> {
+        template<class F, class... Args>
+        static int call(lua_State *, F &f, Args &&...args) {
+            f(std::forward<Args>(args)...);
+            return 0;
+        }
+    };
+
+    template<class... Rs>
+    struct results<std::tuple<Rs...>> {
+        template<class F, class... Args>
+        static int call(lua_State *L, F &f, Args &&...args) {
+            auto values = f(std::forward<Args>(args)...);
+            std::apply([L](const auto &...value) { (push_value(L, value), ...); }, values);
+            return sizeof...(Rs);
+        }
+    };
+
+    // lua_CFunction calling the F stored as upvalue with the signature R(Args...)
+    template<class F, class R, class... Args>
+    struct function {
+        static int call(lua_State *L) {
+            // nothing with a destructor may be alive when raise() unwinds the c stack
+            char msg[256];
+            try {
+                return invoke(L, std::index_sequence_for<Args...>{});
+            } catch (std::exception &e) {
+                copy_message(msg, sizeof msg, e.what());
+            } catch (...) {
+                copy_message(msg, sizeof msg, "unknown c++ exception");
+            }
+            raise(L, msg);
+        }
+
+        template<std::size_t... Is>
+        static int invoke(lua_State *L, std::index_sequence<Is...>) {
+            auto &f = *static_cast<F *>(target(L));
+            return results<R>::call(L, f, param<Args>(L, Is + 1)...);
+        }
+
+        static void copy_message(char *msg, std::size_t size, const char *what) noexcept {
+            auto i = std::size_t{};
+            for (; i + 1 < size && what[i]; ++i)
+                msg[i] = what[i];
+            msg[i] = '\0';
+        }
+    };
+
+    // signature of a callable: function pointer or class with one operator()
+    template<class F>
+    struct signature : signature<decltype(&F::operator())> {};
+
+    template<class R, class... Args>
+    struct signature<R (*)(Args...)> {
+        template<class F>
+        using function_t = function<F, R, Args...>;
+    };
+
+    template<class C, class R, class... Args>
+    struct signature<R (C::*)(Args...)> : signature<R (*)(Args...)> {};
+
+    template<class C, class R, class... Args>
+    struct signature<R (C::*)(Args...) const> : signature<R (*)(Args...)> {};
+} // namespace native
+
+// describes how a class type maps to a lua table. the short form lists the data members,
+// which defines both directions: T can be passed to set_global(), set_field() and
+// set_index(), alone or inside vectors and maps, and read back with table_handle::as<T>():
+// template<> struct luai::table_fields<point> {
+//     static constexpr auto members = std::make_tuple(member("x", &point::x), member("y", &point::y));
+// };
+// members may be numbers, bool, std::string, vectors of those and other mapped types.
+// the long form only writes, for types that do not map member by member:
+// template<> struct luai::table_fields<point> {
+//     static constexpr std::size_t size = 2; // number of fields, presizes the table
+//     static void build(table_builder &t, const point &p) { t.field("x", p.x).field("y", p.y); }
+// };
+template<class T>
+struct table_fields;
+
+// a data member of C named as a table field, see table_fields
+template<class C, class M>
+struct table_member {
+    const char *name;
+    M C::*ptr;
+};
+
+template<class C, class M>
+constexpr table_member<C, M> member(const char *name, M C::*ptr) noexcept {
+    return {name, ptr};
+}
+
+// whether table_fields<T> has the short form
+template<class T, class = void>
+struct has_table_members : std::false_type {};
+
+template<class T>
+struct has_table_members<T, std::void_t<decltype(table_fields<T>::members)>> : std::true_type {};
+
+// fills the table pushed for a table_fields<T>::build() call
+class table_builder {
+public:
+    template<class T>
+    table_builder &field(const char *name, const T &value);
+
+    template<class T>
+    table_builder &index(long long idx, const T &value);
+
+private:
+    lua_State *L;
+    explicit table_builder(lua_State *state) noexcept : L{state} {}
+
+    template<class T, class>
+    friend struct to_lua;
+};
+
+// c++ value -> lua, pushes 1. defined for integers, floating point numbers, bool, strings,
+// std::vector, std::map, std::unordered_map and class types described by table_fields.
+// containers are built with presized tables and no intermediate strings
+template<class T, class = void>
+struct to_lua {
+    static void push(lua_State *L, const T &value) {
+        if constexpr (has_table_members<T>::value) {
+            constexpr auto &members = table_fields<T>::members;
+            native::new_table(L, 0, std::tuple_size<std::decay_t<decltype(members)>>::value);
+            std::apply([L, &value](const auto &...m) { (push_member(L, value, m), ...); }, members);
+        } else {
+            native::new_table(L, 0, table_fields<T>::size);
+            auto builder = table_builder{L};
+            table_fields<T>::build(builder, value);
+        }
+    }
+
+    template<class M>
+    static void push_member(lua_State *L, const T &value, const table_member<T, M> &m) {
+        to_lua<M>::push(L, value.*m.ptr);
+        native::set_field(L, m.name);
+    }
+};
+
+template<class T>
+struct to_lua<T, std::enable_if_t<std::is_arithmetic<T>::value>> {
+    static void push(lua_State *L, T value) {
+        native::push_value(L, value);
+    }
+};
+
+template<>
+struct to_lua<std::string> {
+    static void push(lua_State *L, const std::string &value) {
+        native::push<types::STR>(L, value);
+    }
+};
+
+template<>
+struct to_lua<std::string_view> {
+    static void push(lua_State *L, std::string_view value) {
+        native::push<types::STRVIEW>(L, value);
+    }
+};
+
+template<>
+struct to_lua<const char *> {
+    static void push(lua_State *L, const char *value) {
+        native::push_arg(L, value);
+    }
+};
+
+template<std::size_t N>
+struct to_lua<char[N]> : to_lua<const char *> {};
+
+template<class T, class Alloc>
+struct to_lua<std::vector<T, Alloc>> {
+    static void push(lua_State *L, const std::vector<T, Alloc> &value) {
+        native::new_table(L, value.size(), 0);
+        auto idx = 0ll;
+        for (auto &&elem : value) {
+            to_lua<T>::push(L, elem);
+            native::set_index(L, ++idx);
+        }
+    }
+};
+
+// keys and values of maps
+template<class Map>
+struct to_lua_map {
+    static void push(lua_State *L, const Map &value) {
+        native::new_table(L, 0, value.size());
+        for (auto &pair : value) {
+            to_lua<typename Map::key_type>::push(L, pair.first);
+            to_lua<typename Map::mapped_type>::push(L, pair.second);
+            native::set_pair(L);
+        }
+    }
+};
+
+template<class K, class V, class Compare, class Alloc>
+struct to_lua<std::map<K, V, Compare, Alloc>> : to_lua_map<std::map<K, V, Compare, Alloc>> {};
+
+template<class K, class V, class Hash, class Equal, class Alloc>
+struct to_lua<std::unordered_map<K, V, Hash, Equal, Alloc>>
+    : to_lua_map<std::unordered_map<K, V, Hash, Equal, Alloc>> {};
+
+// lua -> c++ value, the reverse of to_lua. read() converts the value at stack index idx
+// into out, in one pass over nested tables. throws luastate_error if it does not fit, the
+// message starting with the path to the bad value, like "[points][2][x] is not ...".
+// defined for integers, floating point numbers, bool, std::string, std::vector and class
+// types whose table_fields list members. vectors are read with raw access
+template<class T, class = void>
+struct from_lua;
+
+namespace native {
+    // "[key]", the path of errors in from_lua
+    std::string key_path(const char *key);
+    std::string key_path(long long key);
+
+    // reads the value on the top into out and pops it, errors get the key in front
+    template<class T, class Key>
+    void read_pushed(lua_State *L, T &out, Key key) {
+        auto idx = top(L);
+        try {
+            from_lua<T>::read(L, idx, out);
+        } catch (luastate_error &e) {
+            pop(L, 1);
+            throw luastate_error{key_path(key) + e.what()};
+        }
+        pop(L, 1);
+    }
+} // namespace native
+
+template<class T, class>
+struct from_lua {
+    static_assert(has_table_members<T>::value, "from_lua needs table_fields<T>::members");
+
+    static void read(lua_State *L, int idx, T &out) {
+        if (!native::is_table(L, idx))
+            throw luastate_error{" is not table"};
+        native::reserve_field(L);
+        std::apply([L, idx, &out](const auto &...m) { (read_member(L, idx, out, m), ...); },
+            table_fields<T>::members);
+    }
+
+    template<class M>
+    static void read_member(lua_State *L, int idx, T &out, const table_member<T, M> &m) {
+        native::get_field(L, idx, m.name);
+        native::read_pushed(L, out.*m.ptr, m.name);
+    }
+};
+
+template<class T>
+struct from_lua<T, std::enable_if_t<std::is_arithmetic<T>::value>> {
+    static void read(lua_State *L, int idx, T &out) {
+        auto value = get_var_t<type_of_v<T>>{};
+        if (!native::to_value(L, idx, value))
+            throw luastate_error{std::string{" is not "} + native::type_what(type_of_v<T>)};
+        if (!native::fits<T>(value))
+            throw luastate_error{" is out of range"};
+        out = static_cast<T>(value);
+    }
+};
+
+template<>
+struct from_lua<std::string> {
+    static void read(lua_State *L, int idx, std::string &out) {
+        if (!native::to_value(L, idx, out))
+            throw luastate_error{std::string{" is not "} + native::type_what(types::STR)};
+    }
+};
+
+template<class T, class Alloc>
+struct from_lua<std::vector<T, Alloc>> {
+    static void read(lua_State *L, int idx, std::vector<T, Alloc> &out) {
+        if (!native::is_table(L, idx))
+            throw luastate_error{" is not table"};
+        native::reserve_field(L);
+        auto n = native::raw_len(L, idx);
+        out.clear();
+        out.resize(n);
+        for (auto i = std::size_t{}; i < n; ++i) {
+            auto key = static_cast<long long>(i) + 1;
+            native::raw_get_index(L, idx, key);
+            if constexpr (std::is_same<T, bool>::value) {
+                // no bool & into std::vector<bool>
+                auto value = false;
+                native::read_pushed(L, value, key);
+                out[i] = value;
+            } else {
+                native::read_pushed(L, out[i], key);
+            }
+        }
+    }
+};
+
+namespace native {
+    // from_lua<T> on the table at idx, for as(). leaves the stack as it was
+    template<class T>
+    T read_table(lua_State *L, int idx) {
+        auto before = top(L);
+        auto out = T{};
+        try {
+            from_lua<T>::read(L, idx, out);
+        } catch (luastate_error &e) {
+            settop(L, before);
+            throw luastate_error{std::string{"variable/field "} + e.what()};
+        } catch (...) {
+            settop(L, before);
+            throw;
+        }
+        return out;
+    }
+
+    // pops the value on the top into t[key] of the table at idx, like t[key] = value in lua
+    void set_pushed(lua_State *L, int idx, const char *key) noexcept;
+    void set_pushed(lua_State *L, int idx, long long key) noexcept;
+
+    // set_field() and set_index() of table_handle and table_frame. Table::locate() checks
+    // the stack and gives the index of the table. the stack is left as it was if pushing
+    // the value throws
+    template<class Table, class Key, class T>
+    void set_in(Table &table, Key key, const T &value) {
+        auto idx = 0;
+        auto L = table.locate(idx);
+        auto before = top(L);
+        try {
+            to_lua<T>::push(L, value);
+        } catch (...) {
+            settop(L, before);
+            throw;
+        }
+        set_pushed(L, idx, key);
+    }
+
+    // the error of get_fields(), lists every field that is not found[i]
+    [[noreturn]] void throw_fields_error(const char *const *varnames, const types *wanted,
+        const bool *found, std::size_t n);
+
+    // get_fields() of table_handle and table_frame, one Table::get_field_unchecked() per
+    // field, in order, after one Table::check_stack()
+    template<types... Types, class Table>
+    std::tuple<get_var_t<Types>...> get_fields(Table &table, const char *const *varnames) {
+        static_assert(sizeof...(Types) > 0, "get_fields() needs at least one field");
+        static_assert(((Types != types::TABLE && Types != types::FUNC) && ...),
+            "get_fields() gets basic types only, use get_field<types::TABLE>() or get_field<types::FUNC>()");
+        constexpr types wanted[] = {Types...};
+        auto result = std::tuple<get_var_t<Types>...>{};
+        bool found[sizeof...(Types)];
+        table.check_stack();
+        std::apply([&](auto &...out) {
+            auto i = std::size_t{};
+            ((found[i] = table.template get_field_unchecked<Types>(varnames[i], out), ++i), ...);
+        }, result);
+        for (auto ok : found)
+            if (!ok)
+                throw_fields_error(varnames, wanted, found, sizeof...(Types));
+        return result;
+    }
+} // namespace native
+
+template<class T>
+table_builder &table_builder::field(const char *name, const T &value) {
+    to_lua<T>::push(L, value);
+    native::set_field(L, name);
+    return *this;
+}
+
+template<class T>
+table_builder &table_builder::index(long long idx, const T &value) {
+    to_lua<T>::push(L, value);
+    native::set_index(L, idx);
+    return *this;
+}
 
 class lua_interpreter {
 public:
@@ -38,6 +787,9 @@ public:
     // opens a new lua state
     lua_interpreter();
 
+    // opens a new lua state allocating through alloc. nullptr means the system allocator
+    explicit lua_interpreter(std::shared_ptr<allocator> alloc);
+
     // MOVE
     lua_interpreter(lua_interpreter &&) noexcept;
     lua_interpreter &operator=(lua_interpreter &&) noexcept;
@@ -47,17 +799,238 @@ public:
     // returns whether executing waas successful PLUS error message
     std::tuple<bool, std::string> run_chunk(const char *code) noexcept;
 
+    // runs a script or precompiled chunk from a file. the file is memory mapped where
+    // possible, so it is never copied into memory as a whole
+    std::tuple<bool, std::string> run_file(const char *path) noexcept;
+
+    // runs a script or precompiled chunk read from in, block_size bytes at a time
+    std::tuple<bool, std::string> run_stream(std::istream &in, const char *chunkname = "=stream",
+        std::size_t block_size = 64 * 1024) noexcept;
+
+    // runs a chunk previously returned by load_chunk() without recompiling it
+    std::tuple<bool, std::string> run_chunk(const chunk_handle &chunk) noexcept;
+
+    // compiles the chunk, or takes it from the chunk cache if the same source was
+    // compiled before. throws luastate_error if the code does not compile
+    chunk_handle load_chunk(const char *code);
+
+    // like run_chunk(), but the run stops once a limit of budget is hit. the third field
+    // tells which one, the first is then false. scripts cannot catch the error for good:
+    // once a limit is hit, every further instruction raises it again. the state stays
+    // usable afterwards. coroutines created during the run are limited too
+    std::tuple<bool, std::string, budget_error> run_chunk(const char *code, const exec_budget &budget) noexcept;
+    std::tuple<bool, std::string, budget_error> run_chunk(const chunk_handle &chunk,
+        const exec_budget &budget) noexcept;
+
+    // like run_chunk(), but compiles through the chunk cache
+    std::tuple<bool, std::string> run_cached(const char *code) noexcept;
+
+    // bounds the chunk cache by total source bytes. least recently used chunks are
+    // evicted first. 0 disables caching
+    void set_chunk_cache_limit(std::size_t bytes) noexcept;
+
+    // if set, compiled chunks are dumped as bytecode to this directory and loaded
+    // from it on a cache miss, so a new process starts warm. nullptr disables it
+    void set_chunk_cache_dir(const char *dir);
+
+    chunk_cache_stats get_chunk_cache_stats() const noexcept;
+
     // opens all standard libraries
     void openlibs() noexcept;
 
+    // closes the state and opens a fresh one with the same allocator, so everything the
+    // old state held is released at once. libraries have to be opened again.
+    // no table_handle or chunk_handle of the old state may be alive
+    void reset();
+
+    // records the globals as the baseline restore_globals() returns to: the global table,
+    // its metatable, and the fields of the tables reachable from it in two steps (the
+    // libraries, package.loaded...). take it once the state is warm, after openlibs()
+    // and the bootstrap chunks
+    void snapshot_globals();
+
+    // puts the globals back as they were at snapshot_globals(), so the next request starts
+    // clean without opening a new state. takes time proportional to the number of globals.
+    // changes deeper in the tables, to upvalues and to the registry are not undone.
+    // throws luastate_error if there is no snapshot. reset() drops the snapshot
+    void restore_globals();
+
+    alloc_stats get_alloc_stats() const noexcept;
+
+    // counters, latency histograms and profiler samples of this state. like the state
+    // itself, call it from the thread that uses the state
+    instrument_snapshot get_instruments() const;
+    void reset_instruments() noexcept;
+
+    // samples the running lua line every interval vm instructions until stopped,
+    // see instrument_snapshot::hot_spots. does nothing without LUAI_INSTRUMENT
+    void start_profiler(int interval = 1000) noexcept;
+    void stop_profiler() noexcept;
+
     // get a global variable
     template<types Type>
     get_var_t<Type> get_global(const char *varname);
 
+    // like get_global(), but a missing or mistyped variable is reported in the result
+    // instead of thrown, see lookup_result
+    template<types Type>
+    lookup_result<Type> try_get_global(const char *varname);
+
+    // the global table varname as a table_frame, see there
+    table_frame frame_global(const char *varname);
+
+    // set a global variable to any value to_lua is defined for. vectors, maps and class
+    // types described by table_fields become new tables, built without going through
+    // lua source. the old value is replaced
+    template<class T>
+    void set_global(const char *varname, const T &value);
+
+    // registers a c++ callable as the global function varname. its signature is read at
+    // compile time: arguments may be integers, floating point numbers, bool, std::string
+    // or std::string_view (valid during the call),
+    // the result one of those, void, or a std::tuple of them for several results.
+    // a mistyped argument or an exception thrown by f is raised as a lua error
+    template<class F>
+    void register_function(const char *varname, F &&f);
+
+    // registers a plain lua_CFunction as the global function varname
+    void register_function(const char *varname, int (*f)(lua_State *));
+
 private:
     struct impl;
     std::shared_ptr<impl> pimpl;
 
+    // stores f in lua and registers Trampoline::call as the global function varname,
+    // which finds f with native::target()
+    template<class Trampoline, class F>
+    void register_native(const char *varname, F &&f);
+
+    // used by register_native(). allocates lua owned storage for the callable on the
+    // stack, aligned to align, then binds it as upvalue of cfunc. destroy is run when lua
+    // collects it
+    void *push_native_storage(std::size_t size, std::size_t align, void (*destroy)(void *));
+    void pop_native_storage() noexcept;
+    void set_native_function(const char *varname, int (*cfunc)(lua_State *));
+
+    // used by set_global() and script_scheduler
+    lua_State *native_state() const noexcept;
+    void set_global_pushed(const char *varname) noexcept;
+
+    // pushes the compiled code from the chunk cache, or the error message
+    // returns the status of lua_load()
+    int push_cached(const char *code);
+
+    friend class table_handle;
+    friend class table_frame;
+    friend class table_ref;
+    friend class chunk_handle;
+    friend class function_handle;
+    friend class view_guard;
+    friend class table_batch;
+    friend class script_scheduler;
+    friend void *native::target(lua_State *) noexcept;
+    template<types Type>
+    friend get_var_t<Type> native::arg(lua_State *, int);
+    template<types Type>
+    friend get_var_t<Type> native::result(lua_State *, int, int);
+};
+
+// types::STRVIEW reads return views into strings owned by lua. such reads need a live
+// view_guard, which keeps every string viewed during its lifetime from being collected,
+// even if the variable or field is reassigned. the views dangle once the guard is gone.
+// guards nest and must be destroyed in reverse order of creation, so keep them in scopes
+class view_guard {
+public:
+    explicit view_guard(lua_interpreter &state);
+    ~view_guard();
+
+    // COPYING, MOVING DELETED
+    view_guard(const view_guard &) = delete;
+    view_guard &operator=(const view_guard &) = delete;
+
+private:
+    std::shared_ptr<lua_interpreter::impl> pstate;
+    // anchored strings before this guard
+    int mark;
+};
+
+// a key or value copied out of a table by iteration, see table_handle::begin()
+// type is INT, NUM, STR, BOOL, TABLE, FUNC or OTHER. strings point into the batch or
+// iterator they were read by and are valid until it moves on to the next pairs.
+// tables, functions and other values only carry their type
+struct table_value {
+    types type;
+    union {
+        long long integer;
+        double number;
+        bool boolean;
+    };
+    std::string_view string;
+
+    // the value as INT, NUM (integers convert), STR, STRVIEW or BOOL
+    // throws luastate_error if the value does not have the type
+    template<types Type>
+    get_var_t<Type> as() const;
+
+private:
+    [[noreturn]] void throw_mismatch(types wanted) const;
+};
+
+struct table_entry {
+    table_value key;
+    table_value value;
+};
+
+// pairs of a table copied into one flat buffer, filled by table_handle::next_batch().
+// reading a batch does not touch lua, so draining a table costs one call per batch
+// instead of one per pair. a batch follows one table at a time and starts over when
+// given another table. the traversal order is the one of lua_next(), so the table must
+// not get new keys while it is being drained. a fill that finds the last key removed
+// since throws luastate_error
+class table_batch {
+public:
+    // capacity is the maximal number of pairs per fill
+    explicit table_batch(std::size_t capacity = 256) noexcept;
+
+    const table_entry *begin() const noexcept { return entries.data(); }
+    const table_entry *end() const noexcept { return entries.data() + entries.size(); }
+    std::size_t size() const noexcept { return entries.size(); }
+    bool empty() const noexcept { return entries.empty(); }
+    const table_entry &operator[](std::size_t i) const noexcept { return entries[i]; }
+
+    // the next fill starts from the first pair again
+    void rewind() noexcept;
+
+    // COPY
+    table_batch(const table_batch &);
+    table_batch &operator=(const table_batch &);
+
+    // MOVE
+    table_batch(table_batch &&) noexcept;
+    table_batch &operator=(table_batch &&) noexcept;
+
+    ~table_batch();
+
+private:
+    std::vector<table_entry> entries;
+    // bytes of the strings in entries, in order
+    std::string chars;
+    std::size_t capacity;
+
+    // where the traversal stopped: the table being drained and the last key read, kept
+    // in the registry at table_ref and key_ref. table_ref is 0 until the first fill,
+    // key_ref also once the traversal is over
+    std::shared_ptr<lua_interpreter::impl> pstate;
+    int table_ref;
+    int key_ref;
+    bool done;
+    // state generation key_ref belongs to
+    unsigned generation;
+
+    // points the strings of entries to chars again
+    void relink() noexcept;
+    void release_key() noexcept;
+
     friend class table_handle;
 };
 
@@ -70,14 +1043,70 @@ public:
     template<types Type>
     get_var_t<Type> get_field(const char *varname);
 
+    // get several fields of basic types from the current table in one pass, in the order of the names:
+    // auto row = tbl.get_fields<types::INT, types::STR>({"id", "name"});
+    // throws one luastate_error listing every missing or mistyped field
+    template<types... Types>
+    std::tuple<get_var_t<Types>...> get_fields(const char *const (&varnames)[sizeof...(Types)]);
+
     // get a field using int index from the current array
     template<types Type>
     get_var_t<Type> get_index(long long idx);
 
+    // like get_field() and get_index(), without throwing, see lookup_result
+    template<types Type>
+    lookup_result<Type> try_get_field(const char *varname);
+
+    template<types Type>
+    lookup_result<Type> try_get_index(long long idx);
+
+    // set a field or an element of the current table, see lua_interpreter::set_global()
+    // like the getters, metamethods are respected
+    template<class T>
+    void set_field(const char *varname, const T &value);
+
+    template<class T>
+    void set_index(long long idx, const T &value);
+
+    // the current table as a T whose table_fields list members, read in one pass:
+    // auto cfg = state.get_global<types::TABLE>("config").as<server_config>();
+    // throws luastate_error naming the path of the first value that does not fit
+    template<class T>
+    T as();
+
+    // a reference to the current table that is not bound to the stack
+    table_ref to_ref();
+
     // get the length of current array. DOES NOT make sense if array contains holes
     // or if __len() metamethod does not return int
     long long len();
 
+    // read the whole array part t[1..n], n being the raw length, with raw access (ignores
+    // metamethods). throws luastate_error if an element is not of the given type
+    template<types Type>
+    std::vector<get_var_t<Type>> to_vector();
+
+    // like to_vector(), but writes into buf, at most bufsize elements
+    // returns the number of elements written
+    template<types Type>
+    std::size_t copy_into(get_var_t<Type> *buf, std::size_t bufsize);
+
+    // copies the next pairs of the table into batch, returns false once there are no more:
+    // auto batch = table_batch{1024};
+    // while (tbl.next_batch(batch))
+    //     for (auto &pair : batch) ...
+    // uses raw access (ignores metamethods)
+    bool next_batch(table_batch &batch);
+
+    // forward iteration over every pair, in batches of ITERATOR_BATCH pairs:
+    // for (auto &[key, value] : tbl) ...
+    // strings stay valid until the iterator moves past the batch they were read in.
+    // iterators hold the table on the stack like a table_handle, keep them in its scope
+    class iterator;
+    static constexpr std::size_t ITERATOR_BATCH = 64;
+    iterator begin();
+    iterator end() noexcept;
+
     // MOVE
     table_handle(table_handle &&) noexcept;
     table_handle &operator=(table_handle &&) noexcept;
@@ -92,6 +1121,375 @@ private:
     std::shared_ptr<impl> pimpl;
     table_handle(std::shared_ptr<lua_interpreter::impl>, std::shared_ptr<impl>);
 
+    // used by get_fields(), defined for basic types
+    // does not check the stack, returns false if the field is missing or mistyped
+    template<types Type>
+    bool get_field_unchecked(const char *varname, get_var_t<Type> &out);
+    void check_stack();
+    // used by as() and native::set_in(), checks the stack and gives the index of the table
+    lua_State *locate(int &idx);
+    static bool fill_batch(impl &table, table_batch &batch);
+
+    friend class lua_interpreter;
+    friend class table_ref;
+    template<class Table, class Key, class T>
+    friend void native::set_in(Table &, Key, const T &);
+    template<types... Types, class Table>
+    friend std::tuple<get_var_t<Types>...> native::get_fields(Table &, const char *const *);
+};
+
+class table_handle::iterator {
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = table_entry;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const table_entry *;
+    using reference = const table_entry &;
+
+    // the end iterator
+    iterator() noexcept;
+
+    reference operator*() const noexcept { return batch[pos]; }
+    pointer operator->() const noexcept { return &batch[pos]; }
+
+    iterator &operator++() {
+        ++passed;
+        if (++pos == batch.size())
+            refill();
+        return *this;
+    }
+
+    iterator operator++(int) {
+        auto old = *this;
+        ++*this;
+        return old;
+    }
+
+    // iterators of the same table are equal when they passed the same number of pairs
+    friend bool operator==(const iterator &lhs, const iterator &rhs) noexcept {
+        return lhs.table == rhs.table && lhs.passed == rhs.passed;
+    }
+    friend bool operator!=(const iterator &lhs, const iterator &rhs) noexcept {
+        return !(lhs == rhs);
+    }
+
+private:
+    // the table iterated, nullptr once past the end
+    std::shared_ptr<table_handle::impl> table;
+    table_batch batch;
+    std::size_t pos;
+    std::size_t passed;
+
+    explicit iterator(std::shared_ptr<table_handle::impl>);
+    // reads the next batch, or becomes the end iterator
+    void refill();
+
+    friend class table_handle;
+};
+
+template<types Type>
+get_var_t<Type> table_value::as() const {
+    if constexpr (Type == types::INT) {
+        if (type == types::INT)
+            return integer;
+    } else if constexpr (Type == types::NUM) {
+        if (type == types::NUM)
+            return number;
+        if (type == types::INT)
+            return static_cast<double>(integer);
+    } else if constexpr (Type == types::STR || Type == types::STRVIEW) {
+        if (type == types::STR)
+            return get_var_t<Type>{string};
+    } else if constexpr (Type == types::BOOL) {
+        if (type == types::BOOL)
+            return boolean;
+    } else {
+        static_assert(Type != Type, "table_value::as() gets basic types only");
+    }
+    throw_mismatch(Type);
+}
+
+// a table on the stack like table_handle, without heap allocation or reference counting:
+// auto cfg = state.frame_global("config");
+// auto limits = cfg.frame_field("limits");
+// auto rate = limits.get_field<types::INT>("rate");
+// frames must be destroyed in the reverse order of their creation, also relative to
+// table_handles, which holds for locals of nested scopes. a frame does not keep its parent
+// or the state alive, both must outlive it
+class table_frame {
+public:
+    // same as the getters of table_handle, basic types
+    template<types Type>
+    get_var_t<Type> get_field(const char *varname);
+
+    template<types Type>
+    get_var_t<Type> get_index(long long idx);
+
+    template<types Type>
+    lookup_result<Type> try_get_field(const char *varname);
+
+    template<types Type>
+    lookup_result<Type> try_get_index(long long idx);
+
+    template<types... Types>
+    std::tuple<get_var_t<Types>...> get_fields(const char *const (&varnames)[sizeof...(Types)]);
+
+    template<class T>
+    void set_field(const char *varname, const T &value);
+
+    template<class T>
+    void set_index(long long idx, const T &value);
+
+    long long len();
+
+    template<types Type>
+    std::vector<get_var_t<Type>> to_vector();
+
+    template<types Type>
+    std::size_t copy_into(get_var_t<Type> *buf, std::size_t bufsize);
+
+    // see table_handle::as()
+    template<class T>
+    T as();
+
+    // the nested table as a new frame above this one
+    table_frame frame_field(const char *varname);
+    table_frame frame_index(long long idx);
+
+    // MOVE, the moved from frame pops nothing
+    table_frame(table_frame &&other) noexcept
+        : state{other.state}, L{other.L}, stack_index{other.stack_index}
+    {
+        other.L = nullptr;
+    }
+
+    // COPYING, ASSIGNMENT DELETED
+    table_frame(const table_frame &) = delete;
+    table_frame &operator=(const table_frame &) = delete;
+    table_frame &operator=(table_frame &&) = delete;
+
+    // pops the table, and anything left above it
+    ~table_frame() {
+        if (L)
+            pop(L, stack_index);
+    }
+
+private:
+    lua_interpreter::impl *state;
+    lua_State *L;
+    int stack_index;
+
+    // the table must be on the top of the stack
+    table_frame(lua_interpreter::impl *state, lua_State *L) noexcept
+        : state{state}, L{L}, stack_index{native::top(L)}
+    {}
+
+    static void pop(lua_State *L, int stack_index) noexcept;
+    void check_stack();
+    // see table_handle::get_field_unchecked() and table_handle::locate()
+    template<types Type>
+    bool get_field_unchecked(const char *varname, get_var_t<Type> &out);
+    lua_State *locate(int &idx);
+
+    friend class lua_interpreter;
+    template<class Table, class Key, class T>
+    friend void native::set_in(Table &, Key, const T &);
+    template<types... Types, class Table>
+    friend std::tuple<get_var_t<Types>...> native::get_fields(Table &, const char *const *);
+};
+
+template<types... Types>
+std::tuple<get_var_t<Types>...> table_frame::get_fields(const char *const (&varnames)[sizeof...(Types)]) {
+    return native::get_fields<Types...>(*this, varnames);
+}
+
+template<class T>
+void table_frame::set_field(const char *varname, const T &value) {
+    native::set_in(*this, varname, value);
+}
+
+template<class T>
+void table_frame::set_index(long long idx, const T &value) {
+    native::set_in(*this, idx, value);
+}
+
+template<class T>
+T table_frame::as() {
+    check_stack();
+    return native::read_table<T>(L, stack_index);
+}
+
+// a table kept alive in the lua registry, from table_handle::to_ref()
+// unlike table_handle, it is not bound to the stack: it can be copied, stored in containers
+// and outlive scopes. the table is only pushed for the length of an access, so reaching a
+// deeply nested table again costs one registry lookup instead of walking the path
+class table_ref {
+public:
+    // pushes the table for a longer access, the returned handle follows the table_handle rules
+    table_handle push() const;
+
+    // push, get, pop. basic types and FUNC, use push() for nested tables
+    template<types Type>
+    get_var_t<Type> get_field(const char *varname) const;
+
+    template<types Type>
+    get_var_t<Type> get_index(long long idx) const;
+
+    template<types Type>
+    lookup_result<Type> try_get_field(const char *varname) const;
+
+    template<types Type>
+    lookup_result<Type> try_get_index(long long idx) const;
+
+    // COPY
+    table_ref(const table_ref &) noexcept;
+    table_ref &operator=(const table_ref &) noexcept;
+
+    // MOVE
+    table_ref(table_ref &&) noexcept;
+    table_ref &operator=(table_ref &&) noexcept;
+
+    ~table_ref();
+
+private:
+    struct impl;
+    std::shared_ptr<impl> pimpl;
+    table_ref(std::shared_ptr<impl>);
+
+    friend class table_handle;
+};
+
+template<class F>
+void lua_interpreter::register_function(const char *varname, F &&f) {
+    using callable = std::decay_t<F>;
+    using function_t = typename native::signature<callable>::template function_t<callable>;
+    register_native<function_t>(varname, std::forward<F>(f));
+}
+
+template<class Trampoline, class F>
+void lua_interpreter::register_native(const char *varname, F &&f) {
+    using callable = std::decay_t<F>;
+    auto destroy = std::is_trivially_destructible<callable>::value
+        ? nullptr
+        : +[](void *p) { static_cast<callable *>(p)->~callable(); };
+    auto storage = push_native_storage(sizeof(callable), alignof(callable), destroy);
+    try {
+        new (storage) callable(std::forward<F>(f));
+    } catch (...) {
+        pop_native_storage();
+        throw;
+    }
+    set_native_function(varname, Trampoline::call);
+}
+
+template<class T>
+void lua_interpreter::set_global(const char *varname, const T &value) {
+    auto L = native_state();
+    auto top = native::top(L);
+    try {
+        to_lua<T>::push(L, value);
+    } catch (...) {
+        native::settop(L, top);
+        throw;
+    }
+    set_global_pushed(varname);
+}
+
+template<class T>
+void table_handle::set_field(const char *varname, const T &value) {
+    native::set_in(*this, varname, value);
+}
+
+template<class T>
+void table_handle::set_index(long long idx, const T &value) {
+    native::set_in(*this, idx, value);
+}
+
+template<class T>
+T table_handle::as() {
+    auto idx = 0;
+    auto L = locate(idx);
+    return native::read_table<T>(L, idx);
+}
+
+template<types... Types>
+std::tuple<get_var_t<Types>...> table_handle::get_fields(const char *const (&varnames)[sizeof...(Types)]) {
+    return native::get_fields<Types...>(*this, varnames);
+}
+
+// a lua function kept alive in the lua registry, from get_global<types::FUNC>(),
+// get_field<types::FUNC>() or get_index<types::FUNC>()
+// like chunk_handle, it is not bound to the stack
+class function_handle {
+public:
+    // calls the function. args may be integers, floating point numbers, bool, std::string
+    // or string literals. returns nothing, one value or a std::tuple depending on the
+    // number of Results, which may be any basic type but TABLE and FUNC.
+    // throws luastate_error if the function raises an error or a result is mistyped
+    template<types... Results, class... Args>
+    typename native::returns<Results...>::type call(const Args &...args);
+
+    // COPY
+    function_handle(const function_handle &) noexcept;
+    function_handle &operator=(const function_handle &) noexcept;
+
+    // MOVE
+    function_handle(function_handle &&) noexcept;
+    function_handle &operator=(function_handle &&) noexcept;
+
+    ~function_handle();
+
+private:
+    struct impl;
+    std::shared_ptr<impl> pimpl;
+    function_handle(std::shared_ptr<impl>);
+
+    // pushes the function, makes room for the arguments
+    lua_State *push_function(int nargs);
+    // calls the pushed function, leaves nresults on the stack
+    void call_pushed(int nargs, int nresults);
+
+    friend class lua_interpreter;
+    friend class table_handle;
+    friend class table_ref;
+};
+
+template<types... Results, class... Args>
+typename native::returns<Results...>::type function_handle::call(const Args &...args) {
+    constexpr int nresults = sizeof...(Results);
+    auto L = push_function(sizeof...(Args));
+    auto top = native::top(L) - 1;
+    try {
+        (native::push_arg(L, args), ...);
+    } catch (...) {
+        native::settop(L, top);
+        throw;
+    }
+    call_pushed(sizeof...(Args), nresults);
+    auto guard = native::pop_guard{L, nresults};
+    return native::returns<Results...>::get(L);
+}
+
+// a compiled chunk kept alive in the lua registry
+// unlike table_handle, it is not bound to the stack, so it can be stored and copied freely
+// as long as it is only used with the interpreter that created it
+class chunk_handle {
+public:
+    // COPY
+    chunk_handle(const chunk_handle &) noexcept;
+    chunk_handle &operator=(const chunk_handle &) noexcept;
+
+    // MOVE
+    chunk_handle(chunk_handle &&) noexcept;
+    chunk_handle &operator=(chunk_handle &&) noexcept;
+
+    ~chunk_handle();
+
+private:
+    struct impl;
+    std::shared_ptr<impl> pimpl;
+    chunk_handle(std::shared_ptr<impl>);
+
     friend class lua_interpreter;
 };
 
@@ -0,0 +1,244 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "lua_interpreter.hxx"
+
+using namespace luai;
+
+// the state every benchmark reads from, one value of each type as global, field and index
+constexpr auto FIXTURE =
+    "i = 42 n = 4.2 s = 'hello world' b = true\n"
+    "t = { i = 42, n = 4.2, s = 'hello world', b = true, 42, 4.2, 'hello world', true }\n"
+    "nest = {} do local cur = nest for d = 1, 16 do cur.next = {} cur = cur.next end end\n"
+    "arr = {} for k = 1, 1000 do arr[k] = k end\n";
+
+// generated script of about size bytes, one block with a local per line
+std::string large_script(std::size_t size) {
+    auto code = std::string{"local acc = 0\n"};
+    for (auto k = 0; code.size() < size; ++k)
+        code += "do local v" + std::to_string(k) + " = " + std::to_string(k) + " acc = acc + v"
+              + std::to_string(k) + " end\n";
+    return code;
+}
+
+lua_interpreter &fixture() {
+    static auto state = [] {
+        auto s = lua_interpreter{};
+        s.openlibs();
+        s.run_chunk(FIXTURE);
+        return s;
+    }();
+    return state;
+}
+
+// name of the value of each type in FIXTURE, as global name or field name
+template<types Type>
+constexpr const char *key_of() {
+    switch (Type) {
+    case types::INT: return "i";
+    case types::NUM: return "n";
+    case types::STR: case types::STRVIEW: return "s";
+    default: return "b";
+    }
+}
+
+// index of the value of each type in the array part of t
+template<types Type>
+constexpr long long index_of() {
+    switch (Type) {
+    case types::INT: return 1;
+    case types::NUM: return 2;
+    case types::STR: case types::STRVIEW: return 3;
+    default: return 4;
+    }
+}
+
+// one read, under a view_guard of its own for types::STRVIEW so that the strings
+// anchored by the guard do not pile up over the run. STRVIEW times include the guard
+template<types Type, class Read>
+void read_once(lua_interpreter &state, Read &&read) {
+    if constexpr (Type == types::STRVIEW) {
+        auto guard = view_guard{state};
+        benchmark::DoNotOptimize(read());
+    } else {
+        benchmark::DoNotOptimize(read());
+    }
+}
+
+template<types Type>
+void get_global(benchmark::State &bs) {
+    auto &state = fixture();
+    for (auto _ : bs)
+        read_once<Type>(state, [&] { return state.get_global<Type>(key_of<Type>()); });
+    bs.SetItemsProcessed(bs.iterations());
+}
+BENCHMARK_TEMPLATE(get_global, types::INT);
+BENCHMARK_TEMPLATE(get_global, types::NUM);
+BENCHMARK_TEMPLATE(get_global, types::STR);
+BENCHMARK_TEMPLATE(get_global, types::STRVIEW);
+BENCHMARK_TEMPLATE(get_global, types::BOOL);
+BENCHMARK_TEMPLATE(get_global, types::LTYPE);
+
+template<types Type>
+void get_field(benchmark::State &bs) {
+    auto &state = fixture();
+    auto t = state.get_global<types::TABLE>("t");
+    for (auto _ : bs)
+        read_once<Type>(state, [&] { return t.get_field<Type>(key_of<Type>()); });
+    bs.SetItemsProcessed(bs.iterations());
+}
+BENCHMARK_TEMPLATE(get_field, types::INT);
+BENCHMARK_TEMPLATE(get_field, types::NUM);
+BENCHMARK_TEMPLATE(get_field, types::STR);
+BENCHMARK_TEMPLATE(get_field, types::STRVIEW);
+BENCHMARK_TEMPLATE(get_field, types::BOOL);
+BENCHMARK_TEMPLATE(get_field, types::LTYPE);
+
+template<types Type>
+void get_index(benchmark::State &bs) {
+    auto &state = fixture();
+    auto t = state.get_global<types::TABLE>("t");
+    for (auto _ : bs)
+        read_once<Type>(state, [&] { return t.get_index<Type>(index_of<Type>()); });
+    bs.SetItemsProcessed(bs.iterations());
+}
+BENCHMARK_TEMPLATE(get_index, types::INT);
+BENCHMARK_TEMPLATE(get_index, types::NUM);
+BENCHMARK_TEMPLATE(get_index, types::STR);
+BENCHMARK_TEMPLATE(get_index, types::STRVIEW);
+BENCHMARK_TEMPLATE(get_index, types::BOOL);
+BENCHMARK_TEMPLATE(get_index, types::LTYPE);
+
+// opens and closes range(0) nested handles, nest.next.next...
+void nested_handles(benchmark::State &bs) {
+    auto &state = fixture();
+    auto depth = bs.range(0);
+    auto handles = std::vector<table_handle>{};
+    handles.reserve(static_cast<std::size_t>(depth) + 1);
+    for (auto _ : bs) {
+        handles.emplace_back(state.get_global<types::TABLE>("nest"));
+        for (auto d = 0; d < depth; ++d)
+            handles.emplace_back(handles.back().get_field<types::TABLE>("next"));
+        handles.clear();
+    }
+    bs.SetItemsProcessed(bs.iterations() * depth);
+}
+BENCHMARK(nested_handles)->Arg(1)->Arg(4)->Arg(16);
+
+// the same with table_frames, which pop by truncating the stack
+void nested_frames(benchmark::State &bs) {
+    auto &state = fixture();
+    auto depth = static_cast<int>(bs.range(0));
+    // one frame per recursion level, destroyed in reverse order
+    auto walk = [](auto &self, table_frame &parent, int left) -> void {
+        if (left == 0)
+            return;
+        auto child = parent.frame_field("next");
+        self(self, child, left - 1);
+    };
+    for (auto _ : bs) {
+        auto root = state.frame_global("nest");
+        walk(walk, root, depth);
+    }
+    bs.SetItemsProcessed(bs.iterations() * depth);
+}
+BENCHMARK(nested_frames)->Arg(1)->Arg(4)->Arg(16);
+
+void len(benchmark::State &bs) {
+    auto &state = fixture();
+    auto arr = state.get_global<types::TABLE>("arr");
+    for (auto _ : bs)
+        benchmark::DoNotOptimize(arr.len());
+    bs.SetItemsProcessed(bs.iterations());
+}
+BENCHMARK(len);
+
+void run_chunk_small(benchmark::State &bs) {
+    auto &state = fixture();
+    for (auto _ : bs)
+        benchmark::DoNotOptimize(state.run_chunk("x = 1 + 2"));
+    bs.SetItemsProcessed(bs.iterations());
+}
+BENCHMARK(run_chunk_small);
+
+// compiles and runs a range(0) byte script each time
+void run_chunk_large(benchmark::State &bs) {
+    auto &state = fixture();
+    auto code = large_script(static_cast<std::size_t>(bs.range(0)));
+    for (auto _ : bs)
+        benchmark::DoNotOptimize(state.run_chunk(code.c_str()));
+    bs.SetBytesProcessed(bs.iterations() * static_cast<std::int64_t>(code.size()));
+}
+BENCHMARK(run_chunk_large)->Arg(16 << 10)->Arg(256 << 10);
+
+// same script through the chunk cache, compiled once
+void run_cached_large(benchmark::State &bs) {
+    auto &state = fixture();
+    auto code = large_script(static_cast<std::size_t>(bs.range(0)));
+    for (auto _ : bs)
+        benchmark::DoNotOptimize(state.run_cached(code.c_str()));
+    bs.SetBytesProcessed(bs.iterations() * static_cast<std::int64_t>(code.size()));
+}
+BENCHMARK(run_cached_large)->Arg(16 << 10)->Arg(256 << 10);
+
+// the exception path: reading a string global as int
+void type_mismatch(benchmark::State &bs) {
+    auto &state = fixture();
+    for (auto _ : bs) {
+        try {
+            benchmark::DoNotOptimize(state.get_global<types::INT>("s"));
+        } catch (luastate_error &e) {
+            benchmark::DoNotOptimize(e.what());
+        }
+    }
+    bs.SetItemsProcessed(bs.iterations());
+}
+BENCHMARK(type_mismatch);
+
+// the exception path of a missing field
+void missing_field(benchmark::State &bs) {
+    auto &state = fixture();
+    auto t = state.get_global<types::TABLE>("t");
+    for (auto _ : bs) {
+        try {
+            benchmark::DoNotOptimize(t.get_field<types::INT>("absent"));
+        } catch (luastate_error &e) {
+            benchmark::DoNotOptimize(e.what());
+        }
+    }
+    bs.SetItemsProcessed(bs.iterations());
+}
+BENCHMARK(missing_field);
+
+// the same misses through try_get_field()
+void try_missing_field(benchmark::State &bs) {
+    auto &state = fixture();
+    auto t = state.get_global<types::TABLE>("t");
+    for (auto _ : bs)
+        benchmark::DoNotOptimize(t.try_get_field<types::INT>("absent").value_or(0));
+    bs.SetItemsProcessed(bs.iterations());
+}
+BENCHMARK(try_missing_field);
+
+void try_type_mismatch(benchmark::State &bs) {
+    auto &state = fixture();
+    for (auto _ : bs)
+        benchmark::DoNotOptimize(state.try_get_global<types::INT>("s").value_or(0));
+    bs.SetItemsProcessed(bs.iterations());
+}
+BENCHMARK(try_type_mismatch);
+
+// a hit through try_get_field(), against get_field<types::INT>
+void try_get_field_hit(benchmark::State &bs) {
+    auto &state = fixture();
+    auto t = state.get_global<types::TABLE>("t");
+    for (auto _ : bs)
+        benchmark::DoNotOptimize(*t.try_get_field<types::INT>("i"));
+    bs.SetItemsProcessed(bs.iterations());
+}
+BENCHMARK(try_get_field_hit);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,268 @@
+#include <condition_variable>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "lua.hpp"
+
+#include "script_scheduler.hxx"
+
+using namespace luai;
+
+using sched_clock = std::chrono::steady_clock;
+
+// a script: a coroutine kept alive in the registry
+struct async_call::task {
+    lua_State *thread;
+    int ref;
+    std::promise<std::tuple<bool, std::string>> done;
+    // loop thread only: set while the script is suspended in an async function
+    bool in_call {};
+    bool finished {};
+
+    // guarded by core::lock
+    // the async call is running, serial numbers the calls
+    bool pending {};
+    unsigned serial {};
+    // how the call completed, push is empty for plain resumes
+    bool ok {};
+    std::function<int(lua_State *)> push;
+};
+
+struct async_call::core {
+    // loop thread only
+    std::unordered_map<lua_State *, std::shared_ptr<task>> tasks;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    // guarded by lock: scripts to resume, functions to run, timers by due time
+    std::vector<std::shared_ptr<task>> ready;
+    std::vector<std::function<void()>> posted;
+    std::multimap<sched_clock::time_point, std::function<void()>> timers;
+    // false once the scheduler is gone, completions are dropped then
+    bool alive {true};
+
+    bool has_work() const noexcept {
+        return !ready.empty() || !posted.empty();
+    }
+};
+
+namespace {
+    // continuation of async functions. top is the stack size of the function when it
+    // suspended, script_scheduler::poll() pushed ok, results... above it
+    int resume_call(lua_State *L, int, lua_KContext top) {
+        auto flag = static_cast<int>(top) + 1;
+        if (!lua_toboolean(L, flag)) {
+            lua_settop(L, flag + 1);
+            return lua_error(L);
+        }
+        return lua_gettop(L) - flag;
+    }
+}
+
+void native::suspend(lua_State *L) {
+    lua_yieldk(L, 0, lua_gettop(L), resume_call);
+    std::abort(); // lua_yieldk() does not return from c functions
+}
+
+async_call::async_call(std::shared_ptr<core> sched_core, std::shared_ptr<task> script, unsigned call_serial) noexcept
+    : sched{std::move(sched_core)}, waiting{std::move(script)}, serial{call_serial}
+{}
+
+void async_call::fail(std::string msg) {
+    finish(false, [msg = std::move(msg)](lua_State *L) {
+        to_lua<std::string>::push(L, msg);
+        return 1;
+    });
+}
+
+void async_call::finish(bool ok, std::function<int(lua_State *)> push) {
+    {
+        std::lock_guard<std::mutex> guard{sched->lock};
+        if (!sched->alive || !waiting->pending || waiting->serial != serial)
+            return;
+        waiting->pending = false;
+        waiting->ok = ok;
+        waiting->push = std::move(push);
+        sched->ready.emplace_back(waiting);
+    }
+    sched->wake.notify_one();
+}
+
+script_scheduler::script_scheduler(lua_interpreter &interp)
+    : state{interp}, pimpl{std::make_shared<core>()}
+{}
+
+script_scheduler::~script_scheduler() {
+    {
+        std::lock_guard<std::mutex> guard{pimpl->lock};
+        pimpl->alive = false;
+        pimpl->ready.clear();
+        pimpl->posted.clear();
+        pimpl->timers.clear();
+    }
+    auto L = state.native_state();
+    for (auto &entry : pimpl->tasks)
+        luaL_unref(L, LUA_REGISTRYINDEX, entry.second->ref);
+    pimpl->tasks.clear();
+}
+
+async_call script_scheduler::begin_call(const std::shared_ptr<core> &sched, lua_State *L) {
+    auto found = sched->tasks.find(L);
+    if (found == sched->tasks.end())
+        throw luastate_error{"async function called outside of a scheduled script"};
+    auto &script = found->second;
+    script->in_call = true;
+    std::lock_guard<std::mutex> guard{sched->lock};
+    script->pending = true;
+    return {sched, script, ++script->serial};
+}
+
+void script_scheduler::cancel_call(const std::shared_ptr<core> &sched, lua_State *L) noexcept {
+    auto found = sched->tasks.find(L);
+    if (found == sched->tasks.end())
+        return;
+    auto &script = found->second;
+    script->in_call = false;
+    std::lock_guard<std::mutex> guard{sched->lock};
+    script->pending = false;
+}
+
+std::future<std::tuple<bool, std::string>> script_scheduler::spawn(const char *code) {
+    auto L = state.native_state();
+    auto script = std::make_shared<async_call::task>();
+    auto result = script->done.get_future();
+    if (state.push_cached(code) != LUA_OK) {
+        auto msg = lua_tostring(L, -1);
+        script->done.set_value({ false, msg ? msg : "(error object is not a string)" });
+        lua_pop(L, 1);
+        return result;
+    }
+    script->thread = lua_newthread(L);
+    lua_insert(L, -2);
+    lua_xmove(L, script->thread, 1);
+    script->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    pimpl->tasks.emplace(script->thread, script);
+    {
+        std::lock_guard<std::mutex> guard{pimpl->lock};
+        pimpl->ready.emplace_back(std::move(script));
+    }
+    return result;
+}
+
+void script_scheduler::post(std::function<void()> f) {
+    {
+        std::lock_guard<std::mutex> guard{pimpl->lock};
+        pimpl->posted.emplace_back(std::move(f));
+    }
+    pimpl->wake.notify_one();
+}
+
+void script_scheduler::after(std::chrono::nanoseconds delay, std::function<void()> f) {
+    auto due = sched_clock::now() + std::chrono::duration_cast<sched_clock::duration>(delay);
+    {
+        std::lock_guard<std::mutex> guard{pimpl->lock};
+        pimpl->timers.emplace(due, std::move(f));
+    }
+    pimpl->wake.notify_one();
+}
+
+std::size_t script_scheduler::poll() {
+    auto &sched = *pimpl;
+    auto jobs = std::vector<std::function<void()>>{};
+    {
+        std::lock_guard<std::mutex> guard{sched.lock};
+        jobs.swap(sched.posted);
+        auto now = sched_clock::now();
+        auto due = sched.timers.begin();
+        for (; due != sched.timers.end() && due->first <= now; ++due)
+            jobs.emplace_back(std::move(due->second));
+        sched.timers.erase(sched.timers.begin(), due);
+    }
+    for (auto &job : jobs)
+        job();
+
+    auto resumable = std::vector<std::shared_ptr<async_call::task>>{};
+    {
+        std::lock_guard<std::mutex> guard{sched.lock};
+        resumable.swap(sched.ready);
+    }
+    auto L = state.native_state();
+    auto end_script = [&](const std::shared_ptr<async_call::task> &script, bool ok, const char *msg) {
+        script->done.set_value({ ok, ok ? "" : msg });
+        script->finished = true;
+        luaL_unref(L, LUA_REGISTRYINDEX, script->ref);
+        sched.tasks.erase(script->thread);
+    };
+    for (auto &script : resumable) {
+        if (script->finished)
+            continue;
+        auto co = script->thread;
+        auto nargs = 0;
+        if (script->push) {
+            // the values for resume_call(), above the stack of the suspended function.
+            // ok and an error message fit, the results make room for themselves
+            if (!lua_checkstack(co, 2)) {
+                script->push = nullptr;
+                end_script(script, false, "lua stack overflow");
+                continue;
+            }
+            auto top = lua_gettop(co);
+            lua_pushboolean(co, script->ok);
+            try {
+                nargs = 1 + script->push(co);
+            } catch (std::exception &e) {
+                lua_settop(co, top);
+                lua_pushboolean(co, false);
+                lua_pushstring(co, e.what());
+                nargs = 2;
+            }
+            script->push = nullptr;
+        }
+        auto status = lua_resume(co, L, nargs);
+        if (status == LUA_YIELD) {
+            if (script->in_call) {
+                script->in_call = false;
+            } else {
+                // coroutine.yield(), comes back on the next poll
+                lua_settop(co, 0);
+                std::lock_guard<std::mutex> guard{sched.lock};
+                sched.ready.emplace_back(script);
+            }
+            continue;
+        }
+        if (status == LUA_OK) {
+            end_script(script, true, nullptr);
+        } else {
+            auto msg = lua_tostring(co, -1);
+            end_script(script, false, msg ? msg : "(error object is not a string)");
+        }
+    }
+    return resumable.size();
+}
+
+void script_scheduler::run() {
+    auto &sched = *pimpl;
+    for (;;) {
+        poll();
+        std::unique_lock<std::mutex> guard{sched.lock};
+        if (sched.has_work())
+            continue;
+        if (sched.timers.empty()) {
+            if (sched.tasks.empty())
+                return;
+            sched.wake.wait(guard, [&] { return sched.has_work() || !sched.timers.empty(); });
+        } else {
+            auto due = sched.timers.begin()->first;
+            sched.wake.wait_until(guard, due, [&] {
+                return sched.has_work() || (!sched.timers.empty() && sched.timers.begin()->first < due);
+            });
+        }
+    }
+}
+
+std::size_t script_scheduler::in_flight() const noexcept {
+    return pimpl->tasks.size();
+}
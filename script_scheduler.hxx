@@ -0,0 +1,198 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "lua_interpreter.hxx"
+
+namespace luai {
+
+class script_scheduler;
+
+// a pending operation started by an async function, see script_scheduler::register_async()
+// completing it resumes the script that called the function. it may be copied, moved to
+// other threads and completed from any of them. only the first completion counts
+class async_call {
+public:
+    // the results of the async function in the script, any type to_lua is defined for
+    template<class... Ts>
+    void complete(const Ts &...results);
+
+    // raises msg as lua error in the script
+    void fail(std::string msg);
+
+private:
+    struct task;
+    struct core;
+    std::shared_ptr<core> sched;
+    std::shared_ptr<task> waiting;
+    // which call of the script this is, completions of older calls are dropped
+    unsigned serial;
+    async_call(std::shared_ptr<core>, std::shared_ptr<task>, unsigned) noexcept;
+
+    // strings are copied, so that nothing the caller owns is referenced once it returns
+    template<class T>
+    using stored_t = std::conditional_t<std::is_convertible<T, const char *>::value, std::string, std::decay_t<T>>;
+
+    // push leaves the results on the stack of the script and returns their number
+    void finish(bool ok, std::function<int(lua_State *)> push);
+
+    friend class script_scheduler;
+};
+
+namespace native {
+    // yields the running coroutine until the scheduler resumes it, does not return
+    [[noreturn]] void suspend(lua_State *L);
+
+    // lua_CFunction of async functions: calls the F stored as upvalue with the arguments
+    // converted to Args..., then suspends the script
+    template<class F, class... Args>
+    struct async_function {
+        static int call(lua_State *L) {
+            // same as function::call(), nothing with a destructor may be alive when unwinding
+            char msg[256];
+            auto failed = true;
+            try {
+                invoke(L, std::index_sequence_for<Args...>{});
+                failed = false;
+            } catch (std::exception &e) {
+                function<F, void>::copy_message(msg, sizeof msg, e.what());
+            } catch (...) {
+                function<F, void>::copy_message(msg, sizeof msg, "unknown c++ exception");
+            }
+            if (!failed)
+                suspend(L);
+            raise(L, msg);
+        }
+
+        template<std::size_t... Is>
+        static void invoke(lua_State *L, std::index_sequence<Is...>) {
+            auto &f = *static_cast<F *>(target(L));
+            f(L, arg<type_of_v<Args>>(L, Is + 1)...);
+        }
+    };
+
+    // signature of an async function void(async_call, Args...)
+    template<class F>
+    struct async_signature : async_signature<decltype(&F::operator())> {};
+
+    template<class Call, class... Args>
+    struct async_signature<void (*)(Call, Args...)> {
+        template<class F>
+        using function_t = async_function<F, Args...>;
+    };
+
+    template<class C, class Call, class... Args>
+    struct async_signature<void (C::*)(Call, Args...)> : async_signature<void (*)(Call, Args...)> {};
+
+    template<class C, class Call, class... Args>
+    struct async_signature<void (C::*)(Call, Args...) const> : async_signature<void (*)(Call, Args...)> {};
+} // namespace native
+
+// runs scripts of one lua_interpreter as coroutines on one thread, the loop thread.
+// functions registered with register_async() start an operation and suspend the calling
+// script until the operation completes, instead of blocking the thread, so thousands of
+// scripts can wait at once. for more threads, run one scheduler (and state) per thread.
+//
+// spawn(), register_async() and the loop itself belong to the loop thread. post(),
+// after() and the completion of async calls may come from any thread
+class script_scheduler {
+public:
+    // the state must outlive the scheduler
+    explicit script_scheduler(lua_interpreter &state);
+
+    // scripts still in flight are abandoned, their futures are broken
+    ~script_scheduler();
+
+    // COPYING, MOVING DELETED
+    script_scheduler(const script_scheduler &) = delete;
+    script_scheduler &operator=(const script_scheduler &) = delete;
+
+    // registers f(async_call call, args...) as the global function varname. arguments are
+    // converted like those of lua_interpreter::register_function(). f must start the
+    // operation and return, the script resumes with the values given to call.complete().
+    // async functions can only be called by scripts of this scheduler, outside of
+    // coroutines the scripts create themselves
+    template<class F>
+    void register_async(const char *varname, F &&f);
+
+    // starts code as a new script, compiled through the chunk cache of the state.
+    // the future gets the result once the script returns or fails.
+    // coroutine.yield() at the top of a script lets the other scripts run
+    std::future<std::tuple<bool, std::string>> spawn(const char *code);
+
+    // runs f on the loop thread, on the next poll()
+    void post(std::function<void()> f);
+
+    // runs f on the loop thread once delay has passed
+    void after(std::chrono::nanoseconds delay, std::function<void()> f);
+
+    // runs posted functions and due timers, then resumes every script whose operation
+    // completed. returns the number of scripts resumed. does not block
+    std::size_t poll();
+
+    // polls until no script is in flight and no timer is pending, sleeping in between
+    void run();
+
+    // scripts spawned and not finished
+    std::size_t in_flight() const noexcept;
+
+private:
+    using core = async_call::core;
+    lua_interpreter &state;
+    std::shared_ptr<core> pimpl;
+
+    // the callable stored in lua for f, gives f the pending operation of the calling script
+    template<class F>
+    struct async_target {
+        std::shared_ptr<core> sched;
+        F f;
+
+        template<class... Args>
+        void operator()(lua_State *L, Args &&...args) {
+            auto call = begin_call(sched, L);
+            try {
+                f(std::move(call), std::forward<Args>(args)...);
+            } catch (...) {
+                // raised into the script, which may catch it and go on
+                cancel_call(sched, L);
+                throw;
+            }
+        }
+    };
+
+    // the pending operation of the script running in L
+    // throws luastate_error if L is not a script of this scheduler
+    static async_call begin_call(const std::shared_ptr<core> &sched, lua_State *L);
+
+    // undoes begin_call() once f threw, completions of the call are dropped
+    static void cancel_call(const std::shared_ptr<core> &sched, lua_State *L) noexcept;
+};
+
+template<class... Ts>
+void async_call::complete(const Ts &...results) {
+    finish(true, [values = std::make_tuple(stored_t<Ts>(results)...)](lua_State *L) {
+        return std::apply([L](const auto &...value) {
+            native::reserve_values(L, static_cast<int>(sizeof...(value)));
+            (to_lua<std::decay_t<decltype(value)>>::push(L, value), ...);
+            return static_cast<int>(sizeof...(value));
+        }, values);
+    });
+}
+
+template<class F>
+void script_scheduler::register_async(const char *varname, F &&f) {
+    using callable = std::decay_t<F>;
+    using target_t = async_target<callable>;
+    using function_t = typename native::async_signature<callable>::template function_t<target_t>;
+    state.register_native<function_t>(varname, target_t{pimpl, std::forward<F>(f)});
+}
+
+} // namespace luai